@@ -0,0 +1,544 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __EXCEPTIONS
+#include <stdexcept>
+#endif
+
+#include "typed_queue.h"
+
+
+/*
+ * Opt-in allocation tracing for memory_pool, custom_allocator and safe_malloc.
+ *
+ * The hooks are only compiled in with UTILS_ENABLE_ALLOC_TRACE defined (cmake -DUTILS_ALLOC_TRACE=ON),
+ * and even then nothing is recorded until alloc_tracer::get_instance()->enable(true). A disabled
+ * tracer costs one relaxed load per allocation.
+ *
+ * Every thread records into its own SPSC ring, so recording takes no lock. Events are pulled out
+ * with drain() (or by an alloc_trace_dumper), a full ring drops the event and counts it.
+ *
+ * The recording path is kept to one thread_local access and a 16 byte store: no clock is read
+ * (an event is stamped with the time of the drain that collects it), the thread id lives in the
+ * ring and the tag is an id into a registry.
+ */
+#ifdef UTILS_ENABLE_ALLOC_TRACE
+#define ALLOC_TRACE_EVENT(type, source, ptr, size, alignment) \
+    alloc_tracer::get_instance()->record((type), (source), (ptr), (size), (alignment))
+#else
+#define ALLOC_TRACE_EVENT(type, source, ptr, size, alignment) ((void)0)
+#endif
+
+/*
+ * Events buffered per thread between two drains (16 bytes each, 256 KB per thread by default so
+ * the ring stays in L2). An alloc_trace_dumper drains every ALLOC_TRACE_DRAIN_PERIOD_MS, which
+ * covers about 16M events (allocations plus frees) per second per thread; busier threads need a
+ * larger ring, otherwise events are dropped.
+ */
+#ifndef ALLOC_TRACE_RING_CAPACITY
+#define ALLOC_TRACE_RING_CAPACITY (16384)
+#endif
+
+#ifndef ALLOC_TRACE_DRAIN_PERIOD_MS
+#define ALLOC_TRACE_DRAIN_PERIOD_MS (1)
+#endif
+
+/* Distinct alloc_trace_scope tags, tags beyond that are recorded untagged (power of two) */
+#ifndef ALLOC_TRACE_MAX_TAGS
+#define ALLOC_TRACE_MAX_TAGS (1024)
+#endif
+
+
+enum class alloc_trace_event_type : uint8_t
+{
+    alloc,
+    free
+};
+
+enum class alloc_trace_source : uint8_t
+{
+    memory_pool,
+    custom_allocator,
+    safe_malloc
+};
+
+/* An event as handed out by drain(), the ring holds a packed alloc_tracer::record_s */
+typedef struct
+{
+    uint64_t               drained_ns; /* steady_clock time of the drain that collected it, the event happened since the previous drain */
+    const void*            ptr;
+    uint64_t               size;       /* Requested size, the block size on memory_pool free and 0 on safe_free (saturates at 4 GB) */
+    uint32_t               alignment;
+    uint32_t               thread_id;  /* Small sequential id, assigned on the thread's first event */
+    const char*            tag;        /* Innermost alloc_trace_scope of the thread, nullptr if none */
+    alloc_trace_event_type type;
+    alloc_trace_source     source;
+} alloc_trace_event_s;
+
+
+inline uint64_t alloc_trace_now_ns()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+inline const char* alloc_trace_event_type_name(alloc_trace_event_type type)
+{
+    return (type == alloc_trace_event_type::alloc) ? "alloc" : "free";
+}
+
+inline const char* alloc_trace_source_name(alloc_trace_source source)
+{
+    switch (source)
+    {
+    case alloc_trace_source::memory_pool:      return "memory_pool";
+    case alloc_trace_source::custom_allocator: return "custom_allocator";
+    case alloc_trace_source::safe_malloc:      return "safe_malloc";
+    }
+
+    return "unknown";
+}
+
+
+class alloc_tracer final
+{
+public:
+    typedef void (*leak_handler_t)(const void* pool, const void* ptr, size_t size);
+
+    /* Never destroyed, pools and allocators may still report from static destructors */
+    static alloc_tracer* get_instance()
+    {
+        static alloc_tracer* singleton = new alloc_tracer();
+        return singleton;
+    }
+
+    void enable(bool enabled)
+    {
+        m_enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    bool enabled() const
+    {
+        return m_enabled.load(std::memory_order_relaxed);
+    }
+
+    void record(alloc_trace_event_type type, alloc_trace_source source, const void* ptr, size_t size, size_t alignment)
+    {
+        if (!m_enabled.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+
+        thread_state_s& state = thread_state();
+        thread_ring_s* ring = state.ring ? state.ring : register_thread(state);
+        if (!ring)
+        {
+            return; // The thread is exiting
+        }
+
+        record_s record;
+        record.ptr = ptr;
+        record.size = (size < UINT32_MAX) ? (uint32_t)size : UINT32_MAX;
+        record.tag_id = state.tag_id;
+        record.alignment_log2 = alignment ? (uint8_t)(std::countr_zero(alignment) + 1) : 0; // Alignments are powers of two
+        record.type_and_source = (uint8_t)((uint8_t)type | ((uint8_t)source << 1));
+
+        if (!ring->records.push(record))
+        {
+            // Only the owning thread writes the counter, no need for an atomic increment
+            ring->dropped_events.store(ring->dropped_events.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    }
+
+    /* Hands every buffered event to callback(const alloc_trace_event_s&), returns how many were drained */
+    template<typename _Callback>
+    size_t drain(_Callback&& callback)
+    {
+        // The rings are single consumer, concurrent drains take turns
+        std::lock_guard<std::mutex> drain_lock(m_drain_mtx);
+
+        std::vector<std::shared_ptr<thread_ring_s>> rings;
+        {
+            std::lock_guard<std::mutex> lock(m_rings_mtx);
+            rings = m_rings;
+        }
+
+        size_t num_of_events = 0;
+        alloc_trace_event_s event;
+        event.drained_ns = alloc_trace_now_ns();
+        record_s record;
+        for (std::shared_ptr<thread_ring_s>& ring : rings)
+        {
+            event.thread_id = ring->thread_id;
+            while (ring->records.pop(record))
+            {
+                event.ptr = record.ptr;
+                event.size = record.size;
+                event.alignment = record.alignment_log2 ? ((uint32_t)1 << (record.alignment_log2 - 1)) : 0;
+                event.tag = record.tag_id ? m_tags[record.tag_id - 1].load(std::memory_order_acquire) : nullptr;
+                event.type = (alloc_trace_event_type)(record.type_and_source & 1);
+                event.source = (alloc_trace_source)(record.type_and_source >> 1);
+                callback(event);
+                ++num_of_events;
+            }
+        }
+
+        // Rings of exited threads are dropped once they are empty
+        std::lock_guard<std::mutex> lock(m_rings_mtx);
+        for (size_t i = 0; i < m_rings.size();)
+        {
+            thread_ring_s* ring = m_rings[i].get();
+            if (ring->exited.load(std::memory_order_acquire) && (0 == ring->records.size()))
+            {
+                m_dropped_by_exited_threads += ring->dropped_events.load(std::memory_order_relaxed);
+                m_rings.erase(m_rings.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        return num_of_events;
+    }
+
+    /* Events lost because a ring was full */
+    uint64_t dropped_events()
+    {
+        std::lock_guard<std::mutex> lock(m_rings_mtx);
+
+        uint64_t dropped = m_dropped_by_exited_threads;
+        for (std::shared_ptr<thread_ring_s>& ring : m_rings)
+        {
+            dropped += ring->dropped_events.load(std::memory_order_relaxed);
+        }
+
+        return dropped;
+    }
+
+    /* Called by memory_pool for every block still in use when it is destroyed, nullptr restores the stderr report */
+    void set_leak_handler(leak_handler_t leak_handler)
+    {
+        m_leak_handler.store(leak_handler, std::memory_order_relaxed);
+    }
+
+    void report_leak(const void* pool, const void* ptr, size_t size)
+    {
+        leak_handler_t leak_handler = m_leak_handler.load(std::memory_order_relaxed);
+        if (leak_handler)
+        {
+            leak_handler(pool, ptr, size);
+        }
+        else
+        {
+            fprintf(stderr, "alloc_trace: memory_pool %p leaked %zu bytes at %p\n", pool, size, ptr);
+        }
+    }
+
+    /* Id of tag in the registry, the same pointer always gets the same id. 0 for nullptr or once the registry is full */
+    uint16_t tag_id(const char* tag)
+    {
+        if (!tag)
+        {
+            return 0;
+        }
+
+        // Open addressing on the tag address, slots are only ever filled so a lookup never takes a lock
+        size_t start = (size_t)(((uint64_t)(uintptr_t)tag * 0x9E3779B97F4A7C15ull) >> 32);
+        for (size_t probe = 0; probe < ALLOC_TRACE_MAX_TAGS; ++probe)
+        {
+            size_t index = (start + probe) & (ALLOC_TRACE_MAX_TAGS - 1);
+            const char* slot_tag = m_tags[index].load(std::memory_order_acquire);
+            if (!slot_tag)
+            {
+                if (m_tags[index].compare_exchange_strong(slot_tag, tag, std::memory_order_acq_rel))
+                {
+                    return (uint16_t)(index + 1);
+                }
+            }
+
+            if (slot_tag == tag)
+            {
+                return (uint16_t)(index + 1);
+            }
+        }
+
+        return 0;
+    }
+
+    /* Tag id attached to the calling thread's events, see alloc_trace_scope */
+    static uint16_t& current_tag_id()
+    {
+        return thread_state().tag_id;
+    }
+
+private:
+    static_assert((ALLOC_TRACE_MAX_TAGS & (ALLOC_TRACE_MAX_TAGS - 1)) == 0 && (ALLOC_TRACE_MAX_TAGS < UINT16_MAX), "ALLOC_TRACE_MAX_TAGS must be a power of two below 65535!");
+
+    /* What a thread's ring holds per event, 4 to a cache line */
+    typedef struct
+    {
+        const void* ptr;
+        uint32_t    size;            /* Saturated at UINT32_MAX */
+        uint16_t    tag_id;          /* 0 when untagged */
+        uint8_t     alignment_log2;  /* log2(alignment) + 1, 0 for no alignment */
+        uint8_t     type_and_source; /* type in bit 0, source above it */
+    } record_s;
+
+    static_assert(sizeof(record_s) == 16, "record_s is meant to fill a quarter of a cache line!");
+
+    struct thread_ring_s
+    {
+        typed_queue<record_s, ALLOC_TRACE_RING_CAPACITY, spsc_policy> records;
+        std::atomic<uint64_t> dropped_events{ 0 };
+        std::atomic<bool>     exited{ false };
+        uint32_t              thread_id = 0;
+    };
+
+    /* Keeps the thread's ring registered until it is drained, after the thread exits */
+    struct thread_ring_owner_s
+    {
+        std::shared_ptr<thread_ring_s> ring;
+
+        ~thread_ring_owner_s()
+        {
+            if (ring)
+            {
+                ring->exited.store(true, std::memory_order_release);
+            }
+
+            thread_state().ring = nullptr;
+            thread_state().exited = true;
+        }
+    };
+
+    /* Everything the recording path needs from the calling thread, so it costs a single thread_local access */
+    typedef struct
+    {
+        thread_ring_s* ring;   /* nullptr before the thread's first event and once it exits */
+        uint16_t       tag_id; /* Innermost alloc_trace_scope */
+        bool           exited;
+    } thread_state_s;
+
+    alloc_tracer()
+        : m_enabled(false),
+          m_leak_handler(nullptr),
+          m_next_thread_id(0),
+          m_dropped_by_exited_threads(0)
+    {
+        for (std::atomic<const char*>& tag : m_tags)
+        {
+            tag.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    alloc_tracer(const alloc_tracer&);
+    alloc_tracer& operator=(const alloc_tracer&);
+
+    // Trivially destructible, still readable while the thread's destructors run
+    static thread_state_s& thread_state()
+    {
+        static thread_local thread_state_s state = { nullptr, 0, false };
+        return state;
+    }
+
+    thread_ring_s* register_thread(thread_state_s& state)
+    {
+        if (state.exited)
+        {
+            return nullptr;
+        }
+
+        std::shared_ptr<thread_ring_s> new_ring = std::make_shared<thread_ring_s>();
+        {
+            std::lock_guard<std::mutex> lock(m_rings_mtx);
+            new_ring->thread_id = m_next_thread_id++;
+            m_rings.push_back(new_ring);
+        }
+
+        static thread_local thread_ring_owner_s owner;
+        owner.ring = new_ring;
+
+        state.ring = new_ring.get();
+        return new_ring.get();
+    }
+
+    std::atomic<bool>                           m_enabled;
+    std::atomic<leak_handler_t>                 m_leak_handler;
+    std::mutex                                  m_drain_mtx;
+    std::mutex                                  m_rings_mtx;
+    std::vector<std::shared_ptr<thread_ring_s>> m_rings;
+    uint32_t                                    m_next_thread_id;
+    uint64_t                                    m_dropped_by_exited_threads;
+    std::atomic<const char*>                    m_tags[ALLOC_TRACE_MAX_TAGS]; /* Tag of id index + 1 */
+};
+
+
+/*
+ * Tags the calling thread's allocations until the scope ends, tag must outlive the trace (e.g. a literal).
+ * The tag is looked up in the registry here rather than on every event.
+ */
+class alloc_trace_scope final
+{
+public:
+    explicit alloc_trace_scope(const char* tag)
+        : m_previous_tag_id(alloc_tracer::current_tag_id())
+    {
+        alloc_tracer::current_tag_id() = alloc_tracer::get_instance()->tag_id(tag);
+    }
+
+    ~alloc_trace_scope()
+    {
+        alloc_tracer::current_tag_id() = m_previous_tag_id;
+    }
+
+private:
+    alloc_trace_scope(const alloc_trace_scope&);
+    alloc_trace_scope& operator=(const alloc_trace_scope&);
+
+    uint16_t m_previous_tag_id;
+};
+
+
+/*
+ * Drains the tracer into a file: one CSV line per event, written every ALLOC_TRACE_DRAIN_PERIOD_MS so
+ * the per-thread rings stay small, and every interval a per source/tag hotspot summary accumulated
+ * since the dumper started. The last dump happens on destruction.
+ */
+class alloc_trace_dumper final
+{
+public:
+    alloc_trace_dumper(const char* path, std::chrono::milliseconds interval)
+        : m_file(fopen(path, "w")),
+          m_interval(interval),
+          m_terminate(false)
+    {
+        if (!m_file)
+        {
+#ifdef __EXCEPTIONS
+            throw(std::runtime_error("alloc_trace_dumper: failed to open the dump file"));
+#else
+            return;
+#endif
+        }
+
+        fprintf(m_file, "drained_ns,thread_id,type,source,ptr,size,alignment,tag\n");
+
+        m_thread = std::thread([&]()
+            {
+                std::unique_lock<std::mutex> lck(m_mtx);
+                std::chrono::milliseconds drain_period = std::min(m_interval, std::chrono::milliseconds(ALLOC_TRACE_DRAIN_PERIOD_MS));
+                std::chrono::steady_clock::time_point next_summary = std::chrono::steady_clock::now() + m_interval;
+                while (true)
+                {
+                    bool terminate = m_cv.wait_for(lck, drain_period, [&] { return m_terminate; });
+                    dump_events();
+
+                    if (terminate || (std::chrono::steady_clock::now() >= next_summary))
+                    {
+                        dump_summary();
+                        next_summary = std::chrono::steady_clock::now() + m_interval;
+                    }
+
+                    if (terminate)
+                    {
+                        break;
+                    }
+                }
+            });
+    }
+
+    ~alloc_trace_dumper()
+    {
+        if (m_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lck(m_mtx);
+                m_terminate = true;
+            }
+            m_cv.notify_one();
+            m_thread.join();
+        }
+
+        if (m_file)
+        {
+            fclose(m_file);
+        }
+    }
+
+private:
+    alloc_trace_dumper(const alloc_trace_dumper&);
+    alloc_trace_dumper& operator=(const alloc_trace_dumper&);
+
+    typedef struct
+    {
+        uint64_t allocs;
+        uint64_t frees;
+        uint64_t allocated_bytes;
+    } hotspot_s;
+
+    void dump_events()
+    {
+        alloc_tracer::get_instance()->drain([&](const alloc_trace_event_s& event)
+            {
+                fprintf(m_file, "%llu,%u,%s,%s,%p,%llu,%u,%s\n",
+                    (unsigned long long)event.drained_ns, event.thread_id,
+                    alloc_trace_event_type_name(event.type), alloc_trace_source_name(event.source),
+                    event.ptr, (unsigned long long)event.size, event.alignment, event.tag ? event.tag : "");
+
+                hotspot_s& hotspot = m_hotspots[std::make_pair(event.source, event.tag)];
+                if (event.type == alloc_trace_event_type::alloc)
+                {
+                    ++(hotspot.allocs);
+                    hotspot.allocated_bytes += event.size;
+                }
+                else
+                {
+                    ++(hotspot.frees);
+                }
+            });
+    }
+
+    void dump_summary()
+    {
+        for (const auto& hotspot : m_hotspots)
+        {
+            fprintf(m_file, "# hotspot source=%s tag=%s allocs=%llu frees=%llu allocated_bytes=%llu\n",
+                alloc_trace_source_name(hotspot.first.first), hotspot.first.second ? hotspot.first.second : "", (unsigned long long)hotspot.second.allocs,
+                (unsigned long long)hotspot.second.frees, (unsigned long long)hotspot.second.allocated_bytes);
+        }
+
+        uint64_t dropped_events = alloc_tracer::get_instance()->dropped_events();
+        fprintf(m_file, "# dropped_events=%llu\n", (unsigned long long)dropped_events);
+        if (dropped_events != 0)
+        {
+            fprintf(m_file, "# WARNING: the hotspot counts above miss the dropped events, raise ALLOC_TRACE_RING_CAPACITY or lower ALLOC_TRACE_DRAIN_PERIOD_MS\n");
+        }
+        fflush(m_file);
+    }
+
+    FILE*                                                          m_file;
+    std::chrono::milliseconds                                      m_interval;
+    std::map<std::pair<alloc_trace_source, const char*>, hotspot_s> m_hotspots; /* Keyed by tag address */
+    std::mutex                                                     m_mtx;
+    std::condition_variable                                        m_cv;
+    bool                                                           m_terminate;
+    std::thread                                                    m_thread;
+};
+
+#endif // ALLOC_TRACE_H
@@ -4,29 +4,42 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <thread>
+#include <type_traits>
 
+#include "locks.h"
 
 
-class background_task_executor final
+/* _Lock guards the task queue, any Lockable except null_lock since the worker runs on its own thread */
+template<typename _Lock = std::mutex>
+class basic_background_task_executor final
 {
 public:
-    static background_task_executor* get_instance()
+    static basic_background_task_executor* get_instance()
     {
-        static background_task_executor singleton;
+        static basic_background_task_executor singleton;
         return &singleton;
     }
 
     void add_task(std::function<void(void)> task)
     {
         {
-            std::lock_guard<std::mutex> lck(m_cv_mtx);
+            std::lock_guard<_Lock> lck(m_cv_mtx);
             m_task_q.push(task);
         }
         m_cv.notify_one();
     }
 
 private:
-    background_task_executor()
+    static_assert(is_lockable<_Lock>::value, "lock type must implement lock/try_lock/unlock!");
+    static_assert(!std::is_same<_Lock, null_lock>::value, "the executor is always used from two threads!");
+
+    // std::condition_variable only works with std::mutex, any other lock needs the generic one
+    typedef typename std::conditional<std::is_same<_Lock, std::mutex>::value,
+                                      std::condition_variable,
+                                      std::condition_variable_any>::type condition_variable_t;
+
+    basic_background_task_executor()
         : m_terminate(false)
     {
         m_thread = std::thread([&]()
@@ -36,7 +49,7 @@ private:
                     try
                     {
                         {
-                            std::unique_lock<std::mutex> lck(m_cv_mtx);
+                            std::unique_lock<_Lock> lck(m_cv_mtx);
                             m_cv.wait(lck, [&] {return ((m_task_q.size() != 0) || m_terminate); });
 
                             if (m_terminate)
@@ -49,7 +62,7 @@ private:
                         {
                             std::function<void(void)> cb;
                             {
-                                std::lock_guard<std::mutex> lck(m_cv_mtx);
+                                std::lock_guard<_Lock> lck(m_cv_mtx);
                                 if (m_task_q.size() == 0)
                                 {
                                     break;
@@ -74,14 +87,14 @@ private:
     }
 
 
-    background_task_executor(const background_task_executor&);
+    basic_background_task_executor(const basic_background_task_executor&);
 
-    ~background_task_executor()
+    ~basic_background_task_executor()
     {
         try
         {
             {
-                std::lock_guard<std::mutex> lck(m_cv_mtx);
+                std::lock_guard<_Lock> lck(m_cv_mtx);
                 m_terminate = true;
             }
             m_cv.notify_one();
@@ -95,8 +108,10 @@ private:
     }
 
     std::thread                           m_thread;
-    std::mutex                            m_cv_mtx;
-    std::condition_variable               m_cv;
+    _Lock                                 m_cv_mtx;
+    condition_variable_t                  m_cv;
     std::queue<std::function<void(void)>> m_task_q;
     bool                                  m_terminate;
 };
+
+typedef basic_background_task_executor<> background_task_executor;
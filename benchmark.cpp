@@ -0,0 +1,624 @@
+#include "alloc_trace.h"
+#include "background_task_executor.h"
+#include "custom_allocator.h"
+#include "mem_pool.h"
+#include "dynamic_safe_queue.h"
+#include "locks.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+#define BENCHMARK_FORMAT_VERSION (1)
+#define ALLOCATION_BATCH_SIZE (64)
+#define MEMORY_POOL_SIZE (64 * 1024 * 1024)
+#define QUEUE_SIZE_IN_BYTES (1024 * 1024)
+
+
+/*
+ * One measurement, emitted as a JSON object so runs of different versions can be diffed.
+ * A result whose run didn't do the work it was timed for (e.g. failed allocations) is emitted
+ * with "valid": false and the reason, its timings must not be compared.
+ */
+struct benchmark_result_s
+{
+    std::string                                      suite;
+    std::string                                      name;
+    std::vector<std::pair<std::string, std::string>> params;
+    std::vector<std::pair<std::string, double>>      metrics;
+    std::string                                      invalid_reason; /* Empty for a valid result */
+};
+
+static std::vector<benchmark_result_s> g_results;
+static uint32_t g_scale = 1;
+
+
+static uint64_t now_ns()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Sorts samples in place and returns the value at the requested percentile (0..100) */
+static double percentile(std::vector<uint64_t>& samples, double pct)
+{
+    if (samples.empty())
+    {
+        return 0;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    size_t index = (size_t)((pct / 100.0) * (double)(samples.size() - 1));
+    return (double)samples[index];
+}
+
+static void add_latency_metrics(benchmark_result_s& result, std::vector<uint64_t>& latencies_ns)
+{
+    result.metrics.push_back({ "latency_p50_ns", percentile(latencies_ns, 50) });
+    result.metrics.push_back({ "latency_p90_ns", percentile(latencies_ns, 90) });
+    result.metrics.push_back({ "latency_p99_ns", percentile(latencies_ns, 99) });
+    result.metrics.push_back({ "latency_p999_ns", percentile(latencies_ns, 99.9) });
+    result.metrics.push_back({ "latency_max_ns", percentile(latencies_ns, 100) });
+}
+
+static void run_threads(uint32_t num_of_threads, const std::function<void(uint32_t)>& func)
+{
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < num_of_threads; ++i)
+    {
+        threads.emplace_back(func, i);
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// Allocators
+// ---------------------------------------------------------------------------------------------
+
+struct size_distribution_s
+{
+    const char* name;
+    size_t      min_size;
+    size_t      max_size;
+};
+
+/* Log-uniform sizes in [min_size, max_size], with a fixed seed so every run allocates the same sizes */
+static std::vector<size_t> make_sizes(const size_distribution_s& distribution, size_t count)
+{
+    std::mt19937_64 generator(0x5eed);
+    std::uniform_real_distribution<double> exponent(std::log2((double)distribution.min_size),
+                                                    std::log2((double)distribution.max_size));
+    std::vector<size_t> sizes(count);
+    for (size_t& size : sizes)
+    {
+        size = (size_t)std::exp2(exponent(generator));
+    }
+
+    return sizes;
+}
+
+/* Returns the result it added to g_results, valid until the next one is added */
+template<typename _Allocate, typename _Free>
+static benchmark_result_s& benchmark_allocator(const char* allocator_name, const size_distribution_s& distribution,
+                                uint32_t num_of_threads, _Allocate allocate, _Free free_ptr)
+{
+    const uint32_t rounds = 2000 * g_scale;
+    std::vector<size_t> sizes = make_sizes(distribution, ALLOCATION_BATCH_SIZE * 16);
+    std::atomic<uint64_t> failed_allocations(0);
+
+    uint64_t start = now_ns();
+    run_threads(num_of_threads, [&](uint32_t thread_index)
+        {
+            void* ptrs[ALLOCATION_BATCH_SIZE];
+            size_t offset = (thread_index * ALLOCATION_BATCH_SIZE) % sizes.size();
+            uint64_t failed = 0;
+
+            for (uint32_t round = 0; round < rounds; ++round)
+            {
+                for (uint32_t i = 0; i < ALLOCATION_BATCH_SIZE; ++i)
+                {
+                    ptrs[i] = allocate(sizes[(offset + i) % sizes.size()]);
+                    failed += (ptrs[i] == nullptr) ? 1 : 0;
+                }
+
+                for (uint32_t i = 0; i < ALLOCATION_BATCH_SIZE; ++i)
+                {
+                    free_ptr(ptrs[i], sizes[(offset + i) % sizes.size()]);
+                }
+
+                offset = (offset + ALLOCATION_BATCH_SIZE) % sizes.size();
+            }
+
+            failed_allocations += failed;
+        });
+    uint64_t elapsed_ns = now_ns() - start;
+
+    uint64_t total_ops = (uint64_t)num_of_threads * rounds * ALLOCATION_BATCH_SIZE;
+
+    benchmark_result_s result;
+    result.suite = "allocator";
+    result.name = allocator_name;
+    result.params.push_back({ "size_distribution", distribution.name });
+    result.params.push_back({ "threads", std::to_string(num_of_threads) });
+    result.metrics.push_back({ "alloc_free_pairs", (double)total_ops });
+    result.metrics.push_back({ "ns_per_alloc_free", (double)elapsed_ns / (double)total_ops });
+    result.metrics.push_back({ "mops_per_sec", ((double)total_ops * 1000.0) / (double)elapsed_ns });
+    result.metrics.push_back({ "failed_allocations", (double)failed_allocations.load() });
+    if (failed_allocations.load() != 0)
+    {
+        // Failed calls return early, the timing is not comparable with the other allocators
+        result.invalid_reason = "failed_allocations";
+    }
+    g_results.push_back(result);
+
+    fprintf(stderr, "allocator %-22s %-7s threads: %u  %.1f ns/op%s\n", allocator_name, distribution.name,
+        num_of_threads, (double)elapsed_ns / (double)total_ops,
+        result.invalid_reason.empty() ? "" : "  INVALID: allocations failed");
+
+    return g_results.back();
+}
+
+static void benchmark_allocators()
+{
+    const size_distribution_s distributions[] = {
+        { "small",  16,  128 },
+        { "medium", 256, 4096 },
+        { "mixed",  16,  16384 },
+    };
+    const uint32_t thread_counts[] = { 1, 2, 4 };
+
+    for (const size_distribution_s& distribution : distributions)
+    {
+        for (uint32_t num_of_threads : thread_counts)
+        {
+            benchmark_allocator("malloc", distribution, num_of_threads,
+                [](size_t size) { return malloc(size); },
+                [](void* ptr, size_t) { free(ptr); });
+
+            custom_allocator<uint8_t> allocator;
+            benchmark_allocator("custom_allocator", distribution, num_of_threads,
+                [&](size_t size) { return (void*)allocator.allocate(size); },
+                [&](void* ptr, size_t size) { allocator.deallocate((uint8_t*)ptr, size); });
+
+            {
+                memory_pool<> pool(MEMORY_POOL_SIZE);
+                benchmark_allocator("memory_pool", distribution, num_of_threads,
+                    [&](size_t size) { return pool.malloc(size); },
+                    [&](void* ptr, size_t) { pool.free(ptr); });
+            }
+
+            {
+                memory_pool<std::allocator<uint8_t>, adaptive_mutex> pool(MEMORY_POOL_SIZE);
+                benchmark_allocator("memory_pool_adaptive", distribution, num_of_threads,
+                    [&](size_t size) { return pool.malloc(size); },
+                    [&](void* ptr, size_t) { pool.free(ptr); });
+            }
+        }
+    }
+}
+
+#ifdef UTILS_ENABLE_ALLOC_TRACE
+#define ALLOC_TRACE_OVERHEAD_RUNS (5)
+
+static double metric_value(const benchmark_result_s& result, const char* metric_name)
+{
+    for (const std::pair<std::string, double>& metric : result.metrics)
+    {
+        if (metric.first == metric_name)
+        {
+            return metric.second;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Allocators with and without the tracer recording, the traced result carries the overhead in
+ * percent. A drainer thread empties the rings while the traced run is going, as an
+ * alloc_trace_dumper would, so the timing covers the full recording path. Runs are short and the
+ * overhead is small, so both sides keep the fastest of ALLOC_TRACE_OVERHEAD_RUNS alternating runs.
+ *
+ * A run that dropped any event mostly timed the "ring full" early return and is flagged invalid.
+ * With fewer CPUs than allocating threads plus the drainer the drainer competes with the
+ * allocating threads for CPU time, those rows are labelled oversubscribed.
+ */
+template<typename _Allocate, typename _Free>
+static void benchmark_traced_allocator(const char* allocator_name, uint32_t num_of_threads, _Allocate allocate, _Free free_ptr)
+{
+    const size_distribution_s distribution = { "small", 16, 128 };
+    alloc_tracer* tracer = alloc_tracer::get_instance();
+    std::string traced_name = std::string(allocator_name) + "_traced";
+    bool oversubscribed = (num_of_threads + 1) > std::thread::hardware_concurrency();
+
+    tracer->drain([](const alloc_trace_event_s&) {});
+    uint64_t dropped_before = tracer->dropped_events();
+
+    std::atomic<bool> stop_draining(false);
+    std::atomic<bool> draining(false);
+    uint64_t recorded_events = 0;
+    std::thread drainer([&]()
+        {
+            while (!stop_draining.load(std::memory_order_acquire))
+            {
+                size_t num_of_events = 0;
+                if (draining.load(std::memory_order_acquire))
+                {
+                    num_of_events = tracer->drain([](const alloc_trace_event_s&) {});
+                    recorded_events += num_of_events;
+                }
+
+                if (0 == num_of_events)
+                {
+                    std::this_thread::yield();
+                }
+            }
+
+            recorded_events += tracer->drain([](const alloc_trace_event_s&) {});
+        });
+
+    benchmark_result_s untraced;
+    benchmark_result_s traced;
+    for (uint32_t run = 0; run < ALLOC_TRACE_OVERHEAD_RUNS; ++run)
+    {
+        benchmark_result_s untraced_run = benchmark_allocator(allocator_name, distribution, num_of_threads, allocate, free_ptr);
+        g_results.pop_back();
+        if ((0 == run) || (metric_value(untraced_run, "ns_per_alloc_free") < metric_value(untraced, "ns_per_alloc_free")))
+        {
+            untraced = untraced_run;
+        }
+
+        draining.store(true, std::memory_order_release);
+        tracer->enable(true);
+        benchmark_result_s traced_run = benchmark_allocator(traced_name.c_str(), distribution, num_of_threads, allocate, free_ptr);
+        tracer->enable(false);
+        draining.store(false, std::memory_order_release);
+        g_results.pop_back();
+        if ((0 == run) || (metric_value(traced_run, "ns_per_alloc_free") < metric_value(traced, "ns_per_alloc_free")))
+        {
+            traced = traced_run;
+        }
+    }
+
+    stop_draining.store(true, std::memory_order_release);
+    drainer.join();
+
+    uint64_t dropped_events = tracer->dropped_events() - dropped_before;
+    uint64_t total_events = recorded_events + dropped_events;
+    double drop_ratio = (total_events != 0) ? ((double)dropped_events / (double)total_events) : 0;
+    double untraced_ns = metric_value(untraced, "ns_per_alloc_free");
+    double overhead_percent = (untraced_ns > 0) ? (((metric_value(traced, "ns_per_alloc_free") - untraced_ns) * 100.0) / untraced_ns) : 0;
+
+    untraced.suite = "alloc_trace";
+    traced.suite = "alloc_trace";
+    if (oversubscribed)
+    {
+        untraced.params.push_back({ "oversubscribed", "true" });
+        traced.params.push_back({ "oversubscribed", "true" });
+    }
+    traced.metrics.push_back({ "recorded_events", (double)recorded_events });
+    traced.metrics.push_back({ "dropped_events", (double)dropped_events });
+    traced.metrics.push_back({ "drop_ratio", drop_ratio });
+    traced.metrics.push_back({ "overhead_percent", overhead_percent });
+    if ((dropped_events != 0) && traced.invalid_reason.empty())
+    {
+        traced.invalid_reason = "dropped_events";
+    }
+    g_results.push_back(untraced);
+    g_results.push_back(traced);
+
+    fprintf(stderr, "alloc_trace %-20s threads: %u  %.1f -> %.1f ns/op  overhead: %.1f%%  drop ratio: %.4f%s%s\n",
+        allocator_name, num_of_threads, untraced_ns, metric_value(traced, "ns_per_alloc_free"), overhead_percent, drop_ratio,
+        oversubscribed ? "  (oversubscribed)" : "", (dropped_events != 0) ? "  INVALID: events dropped" : "");
+}
+
+static void benchmark_alloc_trace()
+{
+    const uint32_t thread_counts[] = { 1, 2, 4 };
+
+    for (uint32_t num_of_threads : thread_counts)
+    {
+        custom_allocator<uint8_t> allocator;
+        benchmark_traced_allocator("custom_allocator", num_of_threads,
+            [&](size_t size) { return (void*)allocator.allocate(size); },
+            [&](void* ptr, size_t size) { allocator.deallocate((uint8_t*)ptr, size); });
+
+        memory_pool<> pool(MEMORY_POOL_SIZE);
+        benchmark_traced_allocator("memory_pool", num_of_threads,
+            [&](size_t size) { return pool.malloc(size); },
+            [&](void* ptr, size_t) { pool.free(ptr); });
+    }
+}
+#endif
+
+
+// ---------------------------------------------------------------------------------------------
+// dynamic_safe_queue
+// ---------------------------------------------------------------------------------------------
+
+struct queue_topology_s
+{
+    const char* name;
+    uint32_t    num_of_producers;
+    uint32_t    num_of_consumers;
+};
+
+static void benchmark_queue(const queue_topology_s& topology, uint32_t item_size)
+{
+    uint64_t items_per_producer = ((uint64_t)g_scale * 4 * 1024 * 1024) / item_size;
+    items_per_producer = std::max<uint64_t>(1000, std::min<uint64_t>(50000, items_per_producer));
+    uint64_t total_items = items_per_producer * topology.num_of_producers;
+
+    queue_handler_s queue_handler = {};
+    dynamic_safe_queue::get_instance()->init_queue(&queue_handler, QUEUE_SIZE_IN_BYTES);
+
+    std::atomic<uint64_t> consumed_items(0);
+    std::vector<std::vector<uint64_t>> latencies(topology.num_of_consumers);
+
+    uint64_t start = now_ns();
+    run_threads(topology.num_of_producers + topology.num_of_consumers, [&](uint32_t thread_index)
+        {
+            std::vector<uint8_t> item(item_size);
+
+            if (thread_index < topology.num_of_producers)
+            {
+                for (uint64_t i = 0; i < items_per_producer; ++i)
+                {
+                    // Every item carries its enqueue time, the consumer turns it into a latency sample
+                    uint64_t timestamp = now_ns();
+                    memcpy(item.data(), &timestamp, sizeof(timestamp));
+
+                    while (!dynamic_safe_queue::get_instance()->enqueue(&queue_handler, item.data(), item_size))
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+
+                return;
+            }
+
+            std::vector<uint64_t>& consumer_latencies = latencies[thread_index - topology.num_of_producers];
+            consumer_latencies.reserve((size_t)(total_items / topology.num_of_consumers) + 1);
+
+            uint32_t actual_item_size_in_bytes = 0;
+            while (consumed_items.load(std::memory_order_relaxed) < total_items)
+            {
+                if (!dynamic_safe_queue::get_instance()->dequeue(&queue_handler, item.data(), item_size, &actual_item_size_in_bytes))
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                uint64_t timestamp = 0;
+                memcpy(&timestamp, item.data(), sizeof(timestamp));
+                consumer_latencies.push_back(now_ns() - timestamp);
+                consumed_items.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    uint64_t elapsed_ns = now_ns() - start;
+
+    std::vector<uint64_t> all_latencies;
+    for (std::vector<uint64_t>& consumer_latencies : latencies)
+    {
+        all_latencies.insert(all_latencies.end(), consumer_latencies.begin(), consumer_latencies.end());
+    }
+
+    queue_stats_snapshot_s stats = dynamic_safe_queue::get_instance()->snapshot(&queue_handler);
+    dynamic_safe_queue::get_instance()->destroy_queue(&queue_handler);
+
+    benchmark_result_s result;
+    result.suite = "dynamic_safe_queue";
+    result.name = topology.name;
+    result.params.push_back({ "item_size", std::to_string(item_size) });
+    result.params.push_back({ "producers", std::to_string(topology.num_of_producers) });
+    result.params.push_back({ "consumers", std::to_string(topology.num_of_consumers) });
+    result.metrics.push_back({ "items", (double)total_items });
+    result.metrics.push_back({ "items_per_sec", ((double)total_items * 1e9) / (double)elapsed_ns });
+    result.metrics.push_back({ "mb_per_sec", ((double)total_items * item_size * 1e9) / ((double)elapsed_ns * 1024 * 1024) });
+    add_latency_metrics(result, all_latencies);
+    result.metrics.push_back({ "failed_enqueues", (double)stats.failed_enqueues });
+    result.metrics.push_back({ "contended_locks", (double)stats.contended_locks });
+    result.metrics.push_back({ "lock_wait_ns", (double)stats.lock_wait_ns });
+    g_results.push_back(result);
+
+    fprintf(stderr, "queue %-5s item_size: %5u  %.0f items/s\n", topology.name, item_size,
+        ((double)total_items * 1e9) / (double)elapsed_ns);
+}
+
+static void benchmark_queues()
+{
+    const queue_topology_s topologies[] = {
+        { "spsc", 1, 1 },
+        { "mpsc", 4, 1 },
+        { "mpmc", 2, 2 },
+    };
+    const uint32_t item_sizes[] = { 16, 256, 4096 };
+
+    for (const queue_topology_s& topology : topologies)
+    {
+        for (uint32_t item_size : item_sizes)
+        {
+            benchmark_queue(topology, item_size);
+        }
+    }
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// background_task_executor
+// ---------------------------------------------------------------------------------------------
+
+template<typename _Executor>
+static void benchmark_executor(const char* executor_name)
+{
+    _Executor* executor = _Executor::get_instance();
+
+    // Submit-to-run latency, one task in flight at a time so queueing doesn't hide the wake-up cost
+    const uint32_t latency_samples = 2000 * g_scale;
+    std::vector<uint64_t> latencies;
+    latencies.reserve(latency_samples);
+
+    for (uint32_t i = 0; i < latency_samples; ++i)
+    {
+        std::atomic<uint64_t> run_time(0);
+        uint64_t submit_time = now_ns();
+        executor->add_task([&run_time]() { run_time.store(now_ns(), std::memory_order_release); });
+
+        while (0 == run_time.load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+
+        latencies.push_back(run_time.load(std::memory_order_relaxed) - submit_time);
+    }
+
+    // Throughput, every task is submitted upfront
+    const uint64_t num_of_tasks = 100000 * (uint64_t)g_scale;
+    std::atomic<uint64_t> executed_tasks(0);
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < num_of_tasks; ++i)
+    {
+        executor->add_task([&executed_tasks]() { executed_tasks.fetch_add(1, std::memory_order_acq_rel); });
+    }
+
+    while (executed_tasks.load(std::memory_order_acquire) < num_of_tasks)
+    {
+        std::this_thread::yield();
+    }
+    uint64_t elapsed_ns = now_ns() - start;
+
+    benchmark_result_s result;
+    result.suite = "background_task_executor";
+    result.name = executor_name;
+    result.metrics.push_back({ "latency_samples", (double)latency_samples });
+    add_latency_metrics(result, latencies);
+    result.metrics.push_back({ "tasks", (double)num_of_tasks });
+    result.metrics.push_back({ "tasks_per_sec", ((double)num_of_tasks * 1e9) / (double)elapsed_ns });
+    g_results.push_back(result);
+
+    fprintf(stderr, "executor %-26s %.0f tasks/s\n", executor_name, ((double)num_of_tasks * 1e9) / (double)elapsed_ns);
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// JSON output
+// ---------------------------------------------------------------------------------------------
+
+static std::string json_escape(const std::string& str)
+{
+    std::string escaped;
+    for (char c : str)
+    {
+        if ((c == '"') || (c == '\\'))
+        {
+            escaped += '\\';
+        }
+
+        escaped += c;
+    }
+
+    return escaped;
+}
+
+static void write_json(FILE* out)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"format_version\": %d,\n", BENCHMARK_FORMAT_VERSION);
+    fprintf(out, "  \"timestamp\": %lld,\n", (long long)time(nullptr));
+    fprintf(out, "  \"hardware_concurrency\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(out, "  \"scale\": %u,\n", g_scale);
+    fprintf(out, "  \"results\": [\n");
+
+    for (size_t i = 0; i < g_results.size(); ++i)
+    {
+        const benchmark_result_s& result = g_results[i];
+
+        fprintf(out, "    {\"suite\": \"%s\", \"name\": \"%s\", \"params\": {",
+            json_escape(result.suite).c_str(), json_escape(result.name).c_str());
+
+        for (size_t j = 0; j < result.params.size(); ++j)
+        {
+            fprintf(out, "%s\"%s\": \"%s\"", (j == 0) ? "" : ", ",
+                json_escape(result.params[j].first).c_str(), json_escape(result.params[j].second).c_str());
+        }
+
+        fprintf(out, "}, \"valid\": %s", result.invalid_reason.empty() ? "true" : "false");
+        if (!result.invalid_reason.empty())
+        {
+            fprintf(out, ", \"invalid_reason\": \"%s\"", json_escape(result.invalid_reason).c_str());
+        }
+
+        fprintf(out, ", \"metrics\": {");
+
+        for (size_t j = 0; j < result.metrics.size(); ++j)
+        {
+            fprintf(out, "%s\"%s\": %.3f", (j == 0) ? "" : ", ",
+                json_escape(result.metrics[j].first).c_str(), result.metrics[j].second);
+        }
+
+        fprintf(out, "}}%s\n", (i + 1 == g_results.size()) ? "" : ",");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+
+/* Usage: utils_benchmark [--scale N] [output.json], the JSON goes to stdout when no file is given */
+int main(int argc, char* argv[])
+{
+    const char* output_path = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if ((0 == strcmp(argv[i], "--scale")) && ((i + 1) < argc))
+        {
+            g_scale = (uint32_t)std::max(1, atoi(argv[++i]));
+        }
+        else
+        {
+            output_path = argv[i];
+        }
+    }
+
+    benchmark_allocators();
+#ifdef UTILS_ENABLE_ALLOC_TRACE
+    benchmark_alloc_trace();
+#endif
+    benchmark_queues();
+    benchmark_executor<background_task_executor>("background_task_executor");
+    benchmark_executor<basic_background_task_executor<adaptive_mutex>>("background_task_executor_adaptive");
+
+    FILE* out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "failed to open %s\n", output_path);
+        return 1;
+    }
+
+    write_json(out);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    return 0;
+}
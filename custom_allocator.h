@@ -6,8 +6,11 @@
 #include <limits>
 #include <cstdint>
 
+#include "alloc_trace.h"
+
 #ifdef __EXCEPTIONS
 #include <exception>
+#include <stdexcept>
 #endif
 
 template <typename T>
@@ -36,7 +39,7 @@ public:
         if (n > (std::numeric_limits<std::size_t>::max() / sizeof(T)))
         {
 #ifdef __EXCEPTIONS
-            throw(std::length_error());
+            throw(std::length_error("custom_allocator: allocation size overflow"));
 #else
             return nullptr;
 #endif
@@ -52,11 +55,13 @@ public:
 #endif
         }
 
+        ALLOC_TRACE_EVENT(alloc_trace_event_type::alloc, alloc_trace_source::custom_allocator, x, n * sizeof(T), alignof(T));
         return x;
     }
 
     void deallocate(T* p, std::size_t n)
     {
+        ALLOC_TRACE_EVENT(alloc_trace_event_type::free, alloc_trace_source::custom_allocator, p, n * sizeof(T), alignof(T));
         free(p);
     }
 
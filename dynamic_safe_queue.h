@@ -1,42 +1,153 @@
 #ifndef SAFE_QUEUE_H
 #define SAFE_QUEUE_H
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <string>
 #include <cstdlib>
+#include <cstring>
 #include <mutex>
 
+#include "locks.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+/* Optional growth policy. A zero max_queue_size_in_bytes keeps the queue at a fixed capacity. */
+typedef struct
+{
+    uint32_t max_queue_size_in_bytes;  /* The ring never grows beyond this size */
+    uint32_t growth_factor;            /* The ring size is multiplied by this factor on every growth (>= 2) */
+    uint32_t shrink_occupancy_percent; /* Occupancy at or below this percent counts as low (0 disables shrinking) */
+    uint32_t shrink_after_dequeues;    /* Number of consecutive low occupancy dequeues before shrinking */
+} queue_growth_policy_s;
+
+
+/* Optional overflow mode. A null segment_file_path keeps the queue memory only. */
+typedef struct
+{
+    const char* segment_file_path;     /* Items that don't fit in the ring are appended to this memory-mapped file */
+    uint32_t    segment_size_in_bytes; /* Size of the segment file, enqueue fails once it is full as well */
+} queue_spill_policy_s;
+
+
+/* State of the memory-mapped segment holding the items spilled in FIFO order */
+typedef struct
+{
+    void*    mem_address;
+    uint32_t segment_size_in_bytes;
+    uint32_t read_offset;
+    uint32_t write_offset;
+    uint32_t num_of_items;
+} queue_spill_s;
+
+
+/*
+ * Per queue counters. They are only written while holding the queue lock and are stored
+ * with relaxed atomics, so snapshot() can read them without taking the lock.
+ */
 typedef struct
+{
+    std::atomic<uint64_t> enqueued_items;
+    std::atomic<uint64_t> enqueued_bytes;
+    std::atomic<uint64_t> dequeued_items;
+    std::atomic<uint64_t> dequeued_bytes;
+    std::atomic<uint64_t> failed_enqueues;          /* Ring (and spill segment) full */
+    std::atomic<uint64_t> empty_dequeues;           /* Dequeue on an empty queue */
+    std::atomic<uint64_t> too_small_dequeues;       /* Dequeue with a buffer smaller than the front item */
+    std::atomic<uint64_t> high_watermark_bytes;     /* Highest number of bytes used in the ring */
+    std::atomic<uint64_t> wrap_splits;              /* Items whose header or payload was split at the end of the ring */
+    std::atomic<uint64_t> contended_locks;          /* Lock acquisitions that had to wait */
+    std::atomic<uint64_t> lock_wait_ns;             /* Total time spent waiting for the lock */
+} queue_stats_s;
+
+
+/* Plain copy of queue_stats_s returned by dynamic_safe_queue::snapshot() */
+typedef struct
+{
+    uint64_t enqueued_items;
+    uint64_t enqueued_bytes;
+    uint64_t dequeued_items;
+    uint64_t dequeued_bytes;
+    uint64_t failed_enqueues;
+    uint64_t empty_dequeues;
+    uint64_t too_small_dequeues;
+    uint64_t high_watermark_bytes;
+    uint64_t wrap_splits;
+    uint64_t contended_locks;
+    uint64_t lock_wait_ns;
+} queue_stats_snapshot_s;
+
+
+/* _Lock is any Lockable (std::mutex, adaptive_mutex, null_lock for single-threaded queues, ...) */
+template<typename _Lock = std::mutex>
+struct basic_queue_handler_s
 {
     uint32_t   front;
     uint32_t   rear;
     uint32_t   num_of_items_in_q;
     uint32_t   queue_size_in_bytes;
     uint32_t   free_queue_size_in_bytes;
-    std::mutex mtx;
+    uint32_t   min_queue_size_in_bytes;
+    uint32_t   low_occupancy_dequeues;
+    queue_growth_policy_s growth_policy;
+    queue_spill_s spill;
+    queue_stats_s stats;
+    _Lock      mtx;
     void* mem_address;
-} queue_handler_s;
+};
 
+typedef basic_queue_handler_s<> queue_handler_s;
 
-class dynamic_safe_queue final
+
+template<typename _Lock = std::mutex>
+class basic_dynamic_safe_queue final
 {
 public:
-    static dynamic_safe_queue* get_instance()
+    typedef basic_queue_handler_s<_Lock> queue_handler_s;
+
+    static basic_dynamic_safe_queue* get_instance()
     {
-        static dynamic_safe_queue singleton;
+        static basic_dynamic_safe_queue singleton;
         return &singleton;
     }
 
     bool init_queue(queue_handler_s* queue_handler, uint32_t queue_size_in_bytes)
+    {
+        queue_growth_policy_s fixed_size_policy = {};
+        return init_queue(queue_handler, queue_size_in_bytes, fixed_size_policy);
+    }
+
+    bool init_queue(queue_handler_s* queue_handler, uint32_t queue_size_in_bytes,
+                    const queue_growth_policy_s& growth_policy)
+    {
+        queue_spill_policy_s no_spill_policy = {};
+        return init_queue(queue_handler, queue_size_in_bytes, growth_policy, no_spill_policy);
+    }
+
+    bool init_queue(queue_handler_s* queue_handler, uint32_t queue_size_in_bytes,
+                    const queue_growth_policy_s& growth_policy, const queue_spill_policy_s& spill_policy)
     {
         if (!queue_handler || (0 == queue_size_in_bytes))
         {
             return false;
         }
 
+        if ((growth_policy.max_queue_size_in_bytes != 0) &&
+            ((growth_policy.max_queue_size_in_bytes < queue_size_in_bytes) ||
+             (growth_policy.growth_factor < 2) ||
+             (growth_policy.shrink_occupancy_percent > 100)))
         {
-            std::lock_guard<std::mutex> lock(queue_handler->mtx);
+            return false;
+        }
+
+        {
+            std::lock_guard<_Lock> lock(queue_handler->mtx);
 
             queue_handler->mem_address = malloc(queue_size_in_bytes);
             if (!queue_handler->mem_address)
@@ -44,11 +155,24 @@ public:
                 return false;
             }
 
+            queue_handler->spill = {};
+            if (spill_policy.segment_file_path &&
+                !_map_spill_segment(&(queue_handler->spill), spill_policy))
+            {
+                free(queue_handler->mem_address);
+                queue_handler->mem_address = nullptr;
+                return false;
+            }
+
             queue_handler->queue_size_in_bytes = queue_size_in_bytes;
             queue_handler->free_queue_size_in_bytes = queue_size_in_bytes;
             queue_handler->front = 0;
             queue_handler->num_of_items_in_q = 0;
             queue_handler->rear = 0;
+            queue_handler->min_queue_size_in_bytes = queue_size_in_bytes;
+            queue_handler->low_occupancy_dequeues = 0;
+            queue_handler->growth_policy = growth_policy;
+            _reset_stats(&(queue_handler->stats));
         }
 
         return true;
@@ -56,12 +180,14 @@ public:
 
     void destroy_queue(queue_handler_s* queue_handler)
     {
-        std::lock_guard<std::mutex> lock(queue_handler->mtx);
+        std::lock_guard<_Lock> lock(queue_handler->mtx);
 
         if (queue_handler->mem_address)
         {
             free(queue_handler->mem_address);
         }
+
+        _unmap_spill_segment(&(queue_handler->spill));
     }
 
     bool enqueue(queue_handler_s* queue_handler, const void* item, uint32_t item_size_in_bytes)
@@ -71,67 +197,60 @@ public:
             return false;
         }
 
-        {
-            std::lock_guard<std::mutex> lock(queue_handler->mtx);
-
-            if (!queue_handler->mem_address)
-            {
-                return false;
-            }
+        uint32_t total_item_size = sizeof(item_header_s) + item_size_in_bytes;
 
-            uint32_t total_item_size = sizeof(item_header_s) + item_size_in_bytes;
-            if (total_item_size > queue_handler->free_queue_size_in_bytes)
+        while (true)
+        {
+            uint32_t new_queue_size_in_bytes = 0;
             {
-                return false;
-            }
-
-            item_header_s* item_header = (item_header_s*)((uint8_t*)(queue_handler->mem_address) + queue_handler->rear);
+                stats_lock_guard lock(queue_handler);
 
-            uint32_t continuous_mem_block_size = queue_handler->queue_size_in_bytes - queue_handler->rear;
-            if (total_item_size > continuous_mem_block_size)
-            {
-                if (continuous_mem_block_size >= sizeof(item_header_s))
+                if (!queue_handler->mem_address)
                 {
-                    item_header->item_size = item_size_in_bytes;
-                    continuous_mem_block_size = queue_handler->queue_size_in_bytes - (queue_handler->rear + sizeof(item_header_s));
+                    return false;
+                }
 
-                    if (continuous_mem_block_size == 0)
-                    {
-                        memcpy((uint8_t*)(queue_handler->mem_address), item, item_size_in_bytes);
-                    }
-                    else
+                // Once anything was spilled, new items go behind it to keep the FIFO order
+                if (0 == queue_handler->spill.num_of_items)
+                {
+                    if (total_item_size <= queue_handler->free_queue_size_in_bytes)
                     {
-                        memcpy(item_header->item_ptr, item, continuous_mem_block_size);
-                        memcpy((uint8_t*)(queue_handler->mem_address),
-                            (const uint8_t*)item + continuous_mem_block_size,
-                            item_size_in_bytes - continuous_mem_block_size);
+                        _write_item(queue_handler, item, item_size_in_bytes);
+                        _update_enqueue_stats(queue_handler, item_size_in_bytes, true);
+                        return true;
                     }
+
+                    new_queue_size_in_bytes = _grow_size(queue_handler, total_item_size);
                 }
-                else
+
+                if (0 == new_queue_size_in_bytes)
                 {
-                    item_header_s temp_item_header;
-                    temp_item_header.item_size = item_size_in_bytes;
-
-                    memcpy(item_header, &temp_item_header, continuous_mem_block_size);
-                    memcpy(queue_handler->mem_address,
-                        (const uint8_t*)&temp_item_header + continuous_mem_block_size,
-                        sizeof(item_header_s) - continuous_mem_block_size);
-                    memcpy((uint8_t*)(queue_handler->mem_address) + sizeof(item_header_s) - continuous_mem_block_size,
-                        item, item_size_in_bytes);
+                    bool spilled = _spill_item(queue_handler, item, item_size_in_bytes);
+                    _update_enqueue_stats(queue_handler, item_size_in_bytes, spilled);
+                    return spilled;
                 }
             }
-            else
+
+            // The bigger ring is allocated outside the lock so consumers only wait for the copy
+            void* new_mem_address = malloc(new_queue_size_in_bytes);
+            if (!new_mem_address)
             {
-                item_header->item_size = item_size_in_bytes;
-                memcpy(item_header->item_ptr, item, item_size_in_bytes);
+                stats_lock_guard lock(queue_handler);
+                _update_enqueue_stats(queue_handler, item_size_in_bytes, false);
+                return false;
             }
 
-            queue_handler->rear = (queue_handler->rear + total_item_size) % queue_handler->queue_size_in_bytes;
-            queue_handler->free_queue_size_in_bytes -= total_item_size;
-            ++(queue_handler->num_of_items_in_q);
-        }
+            {
+                stats_lock_guard lock(queue_handler);
 
-        return true;
+                if (!queue_handler->mem_address ||
+                    (new_queue_size_in_bytes <= queue_handler->queue_size_in_bytes) ||
+                    !_resize(queue_handler, new_mem_address, new_queue_size_in_bytes))
+                {
+                    free(new_mem_address); // Another producer already grew the ring
+                }
+            }
+        }
     }
 
     bool dequeue(queue_handler_s* queue_handler, void* item,
@@ -142,18 +261,46 @@ public:
             return false;
         }
 
+        uint32_t new_queue_size_in_bytes = 0;
         {
-            std::lock_guard<std::mutex> lock(queue_handler->mtx);
+            stats_lock_guard lock(queue_handler);
 
             if (!_peek(queue_handler, item, item_size_in_bytes, actual_item_size_in_bytes))
             {
+                _store_relaxed_add((0 == queue_handler->num_of_items_in_q) ?
+                                       queue_handler->stats.empty_dequeues :
+                                       queue_handler->stats.too_small_dequeues, 1);
                 return false;
             }
 
+            _store_relaxed_add(queue_handler->stats.dequeued_items, 1);
+            _store_relaxed_add(queue_handler->stats.dequeued_bytes, *actual_item_size_in_bytes);
+
             uint32_t total_item_size = sizeof(item_header_s) + (*actual_item_size_in_bytes);
             queue_handler->front = (queue_handler->front + total_item_size) % queue_handler->queue_size_in_bytes;
             queue_handler->free_queue_size_in_bytes += total_item_size;
             --(queue_handler->num_of_items_in_q);
+
+            _replay_spilled_items(queue_handler);
+
+            new_queue_size_in_bytes = _shrink_size(queue_handler);
+        }
+
+        if (new_queue_size_in_bytes != 0)
+        {
+            // Like growing, the smaller ring is allocated outside the lock
+            void* new_mem_address = malloc(new_queue_size_in_bytes);
+            if (new_mem_address)
+            {
+                stats_lock_guard lock(queue_handler);
+
+                if (!queue_handler->mem_address ||
+                    (new_queue_size_in_bytes >= queue_handler->queue_size_in_bytes) ||
+                    !_resize(queue_handler, new_mem_address, new_queue_size_in_bytes))
+                {
+                    free(new_mem_address);
+                }
+            }
         }
 
         return true;
@@ -168,7 +315,7 @@ public:
         }
 
         {
-            std::lock_guard<std::mutex> lock(queue_handler->mtx);
+            stats_lock_guard lock(queue_handler);
             return _peek(queue_handler, item, item_size_in_bytes, actual_item_size_in_bytes);
         }
     }
@@ -181,17 +328,43 @@ public:
         }
 
         {
-            std::lock_guard<std::mutex> lock(queue_handler->mtx);
-            return queue_handler->num_of_items_in_q;
+            stats_lock_guard lock(queue_handler);
+            return queue_handler->num_of_items_in_q + queue_handler->spill.num_of_items;
         }
     }
 
+    /* Lock-free read of the counters, each one is consistent on its own but not with the others */
+    queue_stats_snapshot_s snapshot(const queue_handler_s* queue_handler) const
+    {
+        queue_stats_snapshot_s snapshot = {};
+        if (!queue_handler)
+        {
+            return snapshot;
+        }
+
+        const queue_stats_s& stats = queue_handler->stats;
+        snapshot.enqueued_items = stats.enqueued_items.load(std::memory_order_relaxed);
+        snapshot.enqueued_bytes = stats.enqueued_bytes.load(std::memory_order_relaxed);
+        snapshot.dequeued_items = stats.dequeued_items.load(std::memory_order_relaxed);
+        snapshot.dequeued_bytes = stats.dequeued_bytes.load(std::memory_order_relaxed);
+        snapshot.failed_enqueues = stats.failed_enqueues.load(std::memory_order_relaxed);
+        snapshot.empty_dequeues = stats.empty_dequeues.load(std::memory_order_relaxed);
+        snapshot.too_small_dequeues = stats.too_small_dequeues.load(std::memory_order_relaxed);
+        snapshot.high_watermark_bytes = stats.high_watermark_bytes.load(std::memory_order_relaxed);
+        snapshot.wrap_splits = stats.wrap_splits.load(std::memory_order_relaxed);
+        snapshot.contended_locks = stats.contended_locks.load(std::memory_order_relaxed);
+        snapshot.lock_wait_ns = stats.lock_wait_ns.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+
 
 private:
 
-    dynamic_safe_queue() { }
-    dynamic_safe_queue(const dynamic_safe_queue&);
-    dynamic_safe_queue(const dynamic_safe_queue&&);
+    static_assert(is_lockable<_Lock>::value, "lock type must implement lock/try_lock/unlock!");
+
+    basic_dynamic_safe_queue() { }
+    basic_dynamic_safe_queue(const basic_dynamic_safe_queue&);
+    basic_dynamic_safe_queue(const basic_dynamic_safe_queue&&);
 
     typedef struct
     {
@@ -201,10 +374,345 @@ private:
     } item_header_s;
 
 
+    /* Takes the queue lock and accounts for the time spent waiting when it is contended */
+    class stats_lock_guard final
+    {
+    public:
+        explicit stats_lock_guard(queue_handler_s* queue_handler)
+            : m_queue_handler(queue_handler)
+        {
+            if (!m_queue_handler->mtx.try_lock())
+            {
+                std::chrono::steady_clock::time_point wait_start = std::chrono::steady_clock::now();
+                m_queue_handler->mtx.lock();
+                std::chrono::nanoseconds wait_time = std::chrono::steady_clock::now() - wait_start;
+
+                _store_relaxed_add(m_queue_handler->stats.contended_locks, 1);
+                _store_relaxed_add(m_queue_handler->stats.lock_wait_ns, (uint64_t)wait_time.count());
+            }
+        }
+
+        ~stats_lock_guard()
+        {
+            m_queue_handler->mtx.unlock();
+        }
+
+    private:
+        stats_lock_guard(const stats_lock_guard&);
+        stats_lock_guard& operator=(const stats_lock_guard&);
+
+        queue_handler_s* m_queue_handler;
+    };
+
+    /* Writers are serialized by the queue lock, so a relaxed load and store is enough (no locked add) */
+    static void _store_relaxed_add(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static void _reset_stats(queue_stats_s* stats)
+    {
+        stats->enqueued_items.store(0, std::memory_order_relaxed);
+        stats->enqueued_bytes.store(0, std::memory_order_relaxed);
+        stats->dequeued_items.store(0, std::memory_order_relaxed);
+        stats->dequeued_bytes.store(0, std::memory_order_relaxed);
+        stats->failed_enqueues.store(0, std::memory_order_relaxed);
+        stats->empty_dequeues.store(0, std::memory_order_relaxed);
+        stats->too_small_dequeues.store(0, std::memory_order_relaxed);
+        stats->high_watermark_bytes.store(0, std::memory_order_relaxed);
+        stats->wrap_splits.store(0, std::memory_order_relaxed);
+        stats->contended_locks.store(0, std::memory_order_relaxed);
+        stats->lock_wait_ns.store(0, std::memory_order_relaxed);
+    }
+
+    void _update_enqueue_stats(queue_handler_s* queue_handler, uint32_t item_size_in_bytes, bool enqueued)
+    {
+        if (enqueued)
+        {
+            _store_relaxed_add(queue_handler->stats.enqueued_items, 1);
+            _store_relaxed_add(queue_handler->stats.enqueued_bytes, item_size_in_bytes);
+        }
+        else
+        {
+            _store_relaxed_add(queue_handler->stats.failed_enqueues, 1);
+        }
+    }
+
+
+    void _write_item(queue_handler_s* queue_handler, const void* item, uint32_t item_size_in_bytes)
+    {
+        uint32_t total_item_size = sizeof(item_header_s) + item_size_in_bytes;
+
+        item_header_s* item_header = (item_header_s*)((uint8_t*)(queue_handler->mem_address) + queue_handler->rear);
+
+        uint32_t continuous_mem_block_size = queue_handler->queue_size_in_bytes - queue_handler->rear;
+        if (total_item_size > continuous_mem_block_size)
+        {
+            _store_relaxed_add(queue_handler->stats.wrap_splits, 1);
+
+            if (continuous_mem_block_size >= sizeof(item_header_s))
+            {
+                item_header->item_size = item_size_in_bytes;
+                continuous_mem_block_size = queue_handler->queue_size_in_bytes - (queue_handler->rear + sizeof(item_header_s));
+
+                if (continuous_mem_block_size == 0)
+                {
+                    memcpy((uint8_t*)(queue_handler->mem_address), item, item_size_in_bytes);
+                }
+                else
+                {
+                    memcpy(item_header->item_ptr, item, continuous_mem_block_size);
+                    memcpy((uint8_t*)(queue_handler->mem_address),
+                        (const uint8_t*)item + continuous_mem_block_size,
+                        item_size_in_bytes - continuous_mem_block_size);
+                }
+            }
+            else
+            {
+                item_header_s temp_item_header;
+                temp_item_header.item_size = item_size_in_bytes;
+
+                memcpy(item_header, &temp_item_header, continuous_mem_block_size);
+                memcpy(queue_handler->mem_address,
+                    (const uint8_t*)&temp_item_header + continuous_mem_block_size,
+                    sizeof(item_header_s) - continuous_mem_block_size);
+                memcpy((uint8_t*)(queue_handler->mem_address) + sizeof(item_header_s) - continuous_mem_block_size,
+                    item, item_size_in_bytes);
+            }
+        }
+        else
+        {
+            item_header->item_size = item_size_in_bytes;
+            memcpy(item_header->item_ptr, item, item_size_in_bytes);
+        }
+
+        queue_handler->rear = (queue_handler->rear + total_item_size) % queue_handler->queue_size_in_bytes;
+        queue_handler->free_queue_size_in_bytes -= total_item_size;
+        ++(queue_handler->num_of_items_in_q);
+
+        uint64_t used_size = queue_handler->queue_size_in_bytes - queue_handler->free_queue_size_in_bytes;
+        if (used_size > queue_handler->stats.high_watermark_bytes.load(std::memory_order_relaxed))
+        {
+            queue_handler->stats.high_watermark_bytes.store(used_size, std::memory_order_relaxed);
+        }
+    }
+
+    /* Returns the ring size needed to fit an item of total_item_size, or 0 when the ring may not grow */
+    uint32_t _grow_size(queue_handler_s* queue_handler, uint32_t total_item_size) const
+    {
+        const queue_growth_policy_s& policy = queue_handler->growth_policy;
+        if (policy.max_queue_size_in_bytes <= queue_handler->queue_size_in_bytes)
+        {
+            return 0;
+        }
+
+        uint64_t used_size = queue_handler->queue_size_in_bytes - queue_handler->free_queue_size_in_bytes;
+        uint64_t needed_size = used_size + total_item_size;
+        if (needed_size > policy.max_queue_size_in_bytes)
+        {
+            return 0;
+        }
+
+        uint64_t new_size = queue_handler->queue_size_in_bytes;
+        while (new_size < needed_size)
+        {
+            new_size *= policy.growth_factor;
+        }
+
+        if (new_size > policy.max_queue_size_in_bytes)
+        {
+            new_size = policy.max_queue_size_in_bytes;
+        }
+
+        return (uint32_t)new_size;
+    }
+
+    /* Tracks sustained low occupancy and returns the size to shrink to, or 0 when the ring should stay as is */
+    uint32_t _shrink_size(queue_handler_s* queue_handler)
+    {
+        const queue_growth_policy_s& policy = queue_handler->growth_policy;
+        if ((0 == policy.shrink_occupancy_percent) ||
+            (queue_handler->queue_size_in_bytes <= queue_handler->min_queue_size_in_bytes) ||
+            (queue_handler->spill.num_of_items != 0)) // Spilled items must still fit once replayed
+        {
+            return 0;
+        }
+
+        uint64_t used_size = queue_handler->queue_size_in_bytes - queue_handler->free_queue_size_in_bytes;
+        if ((used_size * 100) > ((uint64_t)queue_handler->queue_size_in_bytes * policy.shrink_occupancy_percent))
+        {
+            queue_handler->low_occupancy_dequeues = 0;
+            return 0;
+        }
+
+        if (++(queue_handler->low_occupancy_dequeues) < policy.shrink_after_dequeues)
+        {
+            return 0;
+        }
+
+        queue_handler->low_occupancy_dequeues = 0;
+
+        uint32_t new_size = queue_handler->queue_size_in_bytes / policy.growth_factor;
+        if (new_size < queue_handler->min_queue_size_in_bytes)
+        {
+            new_size = queue_handler->min_queue_size_in_bytes;
+        }
+
+        return (used_size < new_size) ? new_size : 0;
+    }
+
+    /* Moves the live region into new_mem_address contiguously (un-wrapping it) and releases the old ring */
+    bool _resize(queue_handler_s* queue_handler, void* new_mem_address, uint32_t new_queue_size_in_bytes)
+    {
+        uint32_t used_size = queue_handler->queue_size_in_bytes - queue_handler->free_queue_size_in_bytes;
+        if (used_size > new_queue_size_in_bytes)
+        {
+            return false;
+        }
+
+        uint32_t continuous_mem_block_size = queue_handler->queue_size_in_bytes - queue_handler->front;
+        if (used_size <= continuous_mem_block_size)
+        {
+            memcpy(new_mem_address, (uint8_t*)(queue_handler->mem_address) + queue_handler->front, used_size);
+        }
+        else
+        {
+            memcpy(new_mem_address, (uint8_t*)(queue_handler->mem_address) + queue_handler->front, continuous_mem_block_size);
+            memcpy((uint8_t*)new_mem_address + continuous_mem_block_size,
+                queue_handler->mem_address,
+                used_size - continuous_mem_block_size);
+        }
+
+        free(queue_handler->mem_address);
+
+        queue_handler->mem_address = new_mem_address;
+        queue_handler->queue_size_in_bytes = new_queue_size_in_bytes;
+        queue_handler->free_queue_size_in_bytes = new_queue_size_in_bytes - used_size;
+        queue_handler->front = 0;
+        queue_handler->rear = used_size % new_queue_size_in_bytes;
+
+        return true;
+    }
+
+    bool _map_spill_segment(queue_spill_s* spill, const queue_spill_policy_s& spill_policy)
+    {
+#ifndef _WIN32
+        if (spill_policy.segment_size_in_bytes <= sizeof(item_header_s))
+        {
+            return false;
+        }
+
+        int fd = open(spill_policy.segment_file_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        void* mem_address = MAP_FAILED;
+        if (0 == ftruncate(fd, spill_policy.segment_size_in_bytes))
+        {
+            mem_address = mmap(nullptr, spill_policy.segment_size_in_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        // The mapping keeps the segment alive, so neither the descriptor nor the file name are needed anymore
+        close(fd);
+        unlink(spill_policy.segment_file_path);
+
+        if (MAP_FAILED == mem_address)
+        {
+            return false;
+        }
+
+        spill->mem_address = mem_address;
+        spill->segment_size_in_bytes = spill_policy.segment_size_in_bytes;
+        spill->read_offset = 0;
+        spill->write_offset = 0;
+        spill->num_of_items = 0;
+        return true;
+#else
+        (void)spill;
+        (void)spill_policy;
+        return false; // Spilling is only supported on POSIX systems
+#endif
+    }
+
+    void _unmap_spill_segment(queue_spill_s* spill)
+    {
+#ifndef _WIN32
+        if (spill->mem_address)
+        {
+            munmap(spill->mem_address, spill->segment_size_in_bytes);
+        }
+#endif
+        *spill = {};
+    }
+
+    bool _spill_item(queue_handler_s* queue_handler, const void* item, uint32_t item_size_in_bytes)
+    {
+        queue_spill_s* spill = &(queue_handler->spill);
+        uint64_t total_item_size = sizeof(item_header_s) + (uint64_t)item_size_in_bytes;
+
+        // An item bigger than the ring could never be replayed
+        if (!spill->mem_address || (total_item_size > queue_handler->queue_size_in_bytes))
+        {
+            return false;
+        }
+
+        if ((spill->write_offset + total_item_size) > spill->segment_size_in_bytes)
+        {
+            uint32_t used_size = spill->write_offset - spill->read_offset;
+            if ((used_size + total_item_size) > spill->segment_size_in_bytes)
+            {
+                return false;
+            }
+
+            // Compact the segment by moving the items not replayed yet to its start
+            memmove(spill->mem_address, (uint8_t*)(spill->mem_address) + spill->read_offset, used_size);
+            spill->read_offset = 0;
+            spill->write_offset = used_size;
+        }
+
+        item_header_s* item_header = (item_header_s*)((uint8_t*)(spill->mem_address) + spill->write_offset);
+        item_header->item_size = item_size_in_bytes;
+        memcpy(item_header->item_ptr, item, item_size_in_bytes);
+
+        spill->write_offset += (uint32_t)total_item_size;
+        ++(spill->num_of_items);
+        return true;
+    }
+
+    /* Moves spilled items back into the ring, in order, for as long as they fit */
+    void _replay_spilled_items(queue_handler_s* queue_handler)
+    {
+        queue_spill_s* spill = &(queue_handler->spill);
+
+        while (spill->num_of_items != 0)
+        {
+            item_header_s* item_header = (item_header_s*)((uint8_t*)(spill->mem_address) + spill->read_offset);
+            uint32_t total_item_size = sizeof(item_header_s) + item_header->item_size;
+            if (total_item_size > queue_handler->free_queue_size_in_bytes)
+            {
+                break;
+            }
+
+            _write_item(queue_handler, item_header->item_ptr, item_header->item_size);
+
+            spill->read_offset += total_item_size;
+            --(spill->num_of_items);
+        }
+
+        if (0 == spill->num_of_items)
+        {
+            spill->read_offset = 0;
+            spill->write_offset = 0;
+        }
+    }
+
+
     bool _peek(queue_handler_s* queue_handler, void* item,
                uint32_t item_size_in_bytes, uint32_t* actual_item_size_in_bytes)
     {
-        if (!queue_handler->mem_address)
+        if (!queue_handler->mem_address || (0 == queue_handler->num_of_items_in_q))
         {
             return false;
         }
@@ -261,4 +769,7 @@ private:
         return true;
     }
 };
+
+typedef basic_dynamic_safe_queue<> dynamic_safe_queue;
+
 #endif // SAFE_QUEUE_H
@@ -0,0 +1,75 @@
+#include "locks.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+#define ITERATIONS_PER_THREAD (200000)
+#define MAX_THREADS (8)
+
+
+template<typename Lock>
+void run_benchmark(const char* lock_name, uint32_t num_of_threads, bool oversubscribed)
+{
+    static_assert(is_lockable<Lock>::value, "lock must implement lock/try_lock/unlock!");
+
+    Lock lock;
+    uint64_t counter = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < num_of_threads; ++i)
+    {
+        threads.emplace_back([&]()
+            {
+                for (uint32_t j = 0; j < ITERATIONS_PER_THREAD; ++j)
+                {
+                    std::lock_guard<Lock> guard(lock);
+                    ++counter;
+                }
+            });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+    uint64_t total_ops = (uint64_t)num_of_threads * ITERATIONS_PER_THREAD;
+
+    printf("%-16s threads: %2u%s  ns/op: %8.1f  Mops/s: %7.2f%s\n",
+        lock_name,
+        num_of_threads,
+        oversubscribed ? " (oversubscribed)" : "",
+        (double)elapsed.count() / (double)total_ops,
+        ((double)total_ops * 1000.0) / (double)elapsed.count(),
+        (counter == total_ops) ? "" : "  MUTUAL EXCLUSION VIOLATED");
+}
+
+
+int main()
+{
+    // Always runs up to MAX_THREADS: a spinning lock must behave even with more threads than CPUs,
+    // where a preempted holder or next-in-line waiter stalls everyone spinning behind it
+    uint32_t num_of_cpus = std::thread::hardware_concurrency();
+
+    for (uint32_t num_of_threads = 1; num_of_threads <= MAX_THREADS; num_of_threads *= 2)
+    {
+        bool oversubscribed = (0 != num_of_cpus) && (num_of_threads > num_of_cpus);
+
+        run_benchmark<std::mutex>("std::mutex", num_of_threads, oversubscribed);
+        run_benchmark<adaptive_mutex>("adaptive_mutex", num_of_threads, oversubscribed);
+        run_benchmark<ttas_lock>("ttas_lock", num_of_threads, oversubscribed);
+        run_benchmark<ticket_lock>("ticket_lock", num_of_threads, oversubscribed);
+        run_benchmark<mcs_lock>("mcs_lock", num_of_threads, oversubscribed);
+        run_benchmark<filter_lock<MAX_THREADS>>("filter_lock", num_of_threads, oversubscribed);
+        printf("\n");
+    }
+
+    return 0;
+}
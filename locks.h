@@ -0,0 +1,583 @@
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+/*
+ * Every lock in this file implements the standard Lockable interface (lock, try_lock, unlock),
+ * so all of them work with std::lock_guard / std::unique_lock and can be swapped for one another.
+ */
+template<typename T, typename = void>
+struct is_lockable : std::false_type
+{
+};
+
+template<typename T>
+struct is_lockable<T, decltype(std::declval<T&>().lock(),
+                               (void)std::declval<T&>().try_lock(),
+                               std::declval<T&>().unlock())> : std::true_type
+{
+};
+
+
+/* Hints the CPU that we are spinning, so it can save power and give resources to the sibling hyper-thread */
+inline void cpu_relax()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+
+/* Exponential backoff between failed acquisition attempts, falls back to yielding once the cap is reached */
+class exponential_backoff final
+{
+public:
+    explicit exponential_backoff(uint32_t max_spins = 1024)
+        : m_spins(1),
+          m_max_spins(max_spins)
+    {
+    }
+
+    void pause()
+    {
+        if (m_spins >= m_max_spins)
+        {
+            std::this_thread::yield();
+            return;
+        }
+
+        for (uint32_t i = 0; i < m_spins; ++i)
+        {
+            cpu_relax();
+        }
+
+        m_spins <<= 1;
+    }
+
+    void reset()
+    {
+        m_spins = 1;
+    }
+
+private:
+    uint32_t m_spins;
+    uint32_t m_max_spins;
+};
+
+
+/*
+ * N-thread filter lock (the generalization of Peterson's algorithm).
+ * Every thread climbs N - 1 levels, at each level at least one thread (the victim) is left behind.
+ * The loads and stores must be sequentially consistent: the algorithm relies on a store to
+ * level[me] being visible before loading level[k], which plain ints on x86/ARM do not guarantee.
+ *
+ * lock(id)/unlock(id) take a caller assigned id in [0, N). lock()/unlock() claim a free id for
+ * the calling thread instead, so at most N threads compete for the filter at any time.
+ */
+template<size_t N>
+class filter_lock final
+{
+public:
+    filter_lock()
+        : m_owner_slot(0)
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            m_level[i].store(0, std::memory_order_relaxed);
+            m_victim[i].store(0, std::memory_order_relaxed);
+            m_slot_taken[i].store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void lock(size_t id)
+    {
+        for (size_t level = 1; level < N; ++level)
+        {
+            m_level[id].store(level);
+            m_victim[level].store(id);
+
+            exponential_backoff backoff;
+            while (is_blocked(id, level))
+            {
+                backoff.pause();
+            }
+        }
+    }
+
+    bool try_lock(size_t id)
+    {
+        for (size_t level = 1; level < N; ++level)
+        {
+            m_level[id].store(level);
+            m_victim[level].store(id);
+
+            if (is_blocked(id, level))
+            {
+                // Backing out is always safe, it is the same as leaving the critical section
+                m_level[id].store(0);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void unlock(size_t id)
+    {
+        m_level[id].store(0);
+    }
+
+    void lock()
+    {
+        size_t slot = claim_slot();
+        lock(slot);
+        m_owner_slot = slot;
+    }
+
+    bool try_lock()
+    {
+        size_t slot = 0;
+        if (!try_claim_slot(slot))
+        {
+            return false;
+        }
+
+        if (!try_lock(slot))
+        {
+            m_slot_taken[slot].store(false, std::memory_order_release);
+            return false;
+        }
+
+        m_owner_slot = slot;
+        return true;
+    }
+
+    void unlock()
+    {
+        size_t slot = m_owner_slot;
+        unlock(slot);
+        m_slot_taken[slot].store(false, std::memory_order_release);
+    }
+
+private:
+    static_assert(N >= 2, "filter lock needs at least two threads!");
+
+    filter_lock(const filter_lock&);
+    filter_lock& operator=(const filter_lock&);
+
+    /* True while another thread is at our level or above and we are the most recent to arrive at it */
+    bool is_blocked(size_t id, size_t level) const
+    {
+        for (size_t k = 0; k < N; ++k)
+        {
+            if ((k != id) && (m_level[k].load() >= level) && (m_victim[level].load() == id))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool try_claim_slot(size_t& slot)
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            bool expected = false;
+            if (!m_slot_taken[i].load(std::memory_order_relaxed) &&
+                m_slot_taken[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+            {
+                slot = i;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    size_t claim_slot()
+    {
+        size_t slot = 0;
+        exponential_backoff backoff;
+        while (!try_claim_slot(slot))
+        {
+            backoff.pause();
+        }
+
+        return slot;
+    }
+
+    std::atomic<size_t> m_level[N];
+    std::atomic<size_t> m_victim[N];
+    std::atomic<bool>   m_slot_taken[N];
+    size_t              m_owner_slot; /* Only accessed by the thread holding the lock */
+};
+
+
+/* Test-and-test-and-set spin lock, waits on a plain load and backs off exponentially while the lock is taken */
+class ttas_lock final
+{
+public:
+    ttas_lock()
+        : m_locked(false)
+    {
+    }
+
+    void lock()
+    {
+        exponential_backoff backoff;
+        while (true)
+        {
+            // The holder may be preempted, so waiting on the load backs off (and ends up yielding) too
+            while (m_locked.load(std::memory_order_relaxed))
+            {
+                backoff.pause();
+            }
+
+            if (!m_locked.exchange(true, std::memory_order_acquire))
+            {
+                return;
+            }
+
+            backoff.pause();
+        }
+    }
+
+    bool try_lock()
+    {
+        return !m_locked.load(std::memory_order_relaxed) &&
+               !m_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        m_locked.store(false, std::memory_order_release);
+    }
+
+private:
+    ttas_lock(const ttas_lock&);
+    ttas_lock& operator=(const ttas_lock&);
+
+    std::atomic<bool> m_locked;
+};
+
+
+/*
+ * FIFO ticket lock. Waiters far from the head of the line yield right away, the others back off
+ * exponentially and fall back to yielding as well, so a preempted ticket holder doesn't leave
+ * every waiter spinning through its whole timeslice.
+ */
+class ticket_lock final
+{
+public:
+    ticket_lock()
+        : m_next_ticket(0),
+          m_now_serving(0)
+    {
+    }
+
+    void lock()
+    {
+        uint32_t ticket = m_next_ticket.fetch_add(1, std::memory_order_relaxed);
+        exponential_backoff backoff(max_spins_before_yield);
+        while (true)
+        {
+            uint32_t now_serving = m_now_serving.load(std::memory_order_acquire);
+            if (now_serving == ticket)
+            {
+                return;
+            }
+
+            if ((ticket - now_serving) > max_waiters_to_spin)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            backoff.pause();
+        }
+    }
+
+    bool try_lock()
+    {
+        uint32_t now_serving = m_now_serving.load(std::memory_order_acquire);
+        uint32_t ticket = now_serving;
+        return m_next_ticket.compare_exchange_strong(ticket, now_serving + 1, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        m_now_serving.store(m_now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    ticket_lock(const ticket_lock&);
+    ticket_lock& operator=(const ticket_lock&);
+
+    static constexpr uint32_t max_waiters_to_spin = 16;
+    static constexpr uint32_t max_spins_before_yield = 16; /* Kept short, only the next holder can make progress */
+
+    alignas(64) std::atomic<uint32_t> m_next_ticket;
+    alignas(64) std::atomic<uint32_t> m_now_serving;
+};
+
+
+/*
+ * MCS queue lock. Each waiter spins on a flag in its own node, so a release touches a single
+ * remote cache line instead of invalidating every waiter.
+ *
+ * Nodes come from a small per-thread stack, which is why MCS locks held by the same thread must
+ * be released in the reverse order they were taken (as std::lock_guard scopes do). Nesting deeper
+ * than max_nesting falls back to heap allocated nodes.
+ */
+class mcs_lock final
+{
+public:
+    mcs_lock()
+        : m_tail(nullptr),
+          m_owner_node(nullptr)
+    {
+    }
+
+    void lock()
+    {
+        mcs_node_s* node = push_node();
+        mcs_node_s* prev = m_tail.exchange(node, std::memory_order_acq_rel);
+        if (prev)
+        {
+            prev->next.store(node, std::memory_order_release);
+
+            exponential_backoff backoff(64);
+            while (node->locked.load(std::memory_order_acquire))
+            {
+                backoff.pause();
+            }
+        }
+
+        m_owner_node = node;
+    }
+
+    bool try_lock()
+    {
+        mcs_node_s* node = push_node();
+        mcs_node_s* expected = nullptr;
+        if (!m_tail.compare_exchange_strong(expected, node, std::memory_order_acq_rel))
+        {
+            pop_node(node);
+            return false;
+        }
+
+        m_owner_node = node;
+        return true;
+    }
+
+    void unlock()
+    {
+        mcs_node_s* node = m_owner_node;
+        mcs_node_s* next = node->next.load(std::memory_order_acquire);
+        if (!next)
+        {
+            mcs_node_s* expected = node;
+            if (m_tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+            {
+                pop_node(node);
+                return;
+            }
+
+            // A successor swapped the tail but didn't link itself yet, it may be preempted in between
+            exponential_backoff backoff(64);
+            while (!(next = node->next.load(std::memory_order_acquire)))
+            {
+                backoff.pause();
+            }
+        }
+
+        next->locked.store(false, std::memory_order_release);
+        pop_node(node);
+    }
+
+    static constexpr size_t max_nesting = 16;
+
+private:
+    mcs_lock(const mcs_lock&);
+    mcs_lock& operator=(const mcs_lock&);
+
+    struct alignas(64) mcs_node_s
+    {
+        std::atomic<mcs_node_s*> next;
+        std::atomic<bool>        locked;
+    };
+
+    struct node_stack_s
+    {
+        mcs_node_s nodes[max_nesting];
+        size_t     depth;
+    };
+
+    static node_stack_s& thread_node_stack()
+    {
+        static thread_local node_stack_s node_stack = {};
+        return node_stack;
+    }
+
+    static mcs_node_s* push_node()
+    {
+        node_stack_s& node_stack = thread_node_stack();
+        mcs_node_s* node = (node_stack.depth < max_nesting) ? &(node_stack.nodes[node_stack.depth]) : new mcs_node_s;
+        ++(node_stack.depth);
+        node->next.store(nullptr, std::memory_order_relaxed);
+        node->locked.store(true, std::memory_order_relaxed);
+        return node;
+    }
+
+    static void pop_node(mcs_node_s* node)
+    {
+        node_stack_s& node_stack = thread_node_stack();
+        if ((node < node_stack.nodes) || (node >= (node_stack.nodes + max_nesting)))
+        {
+            delete node;
+        }
+
+        --(node_stack.depth);
+    }
+
+    std::atomic<mcs_node_s*> m_tail;
+    mcs_node_s*              m_owner_node; /* Only accessed by the thread holding the lock */
+};
+
+
+
+/* Lock policy for components that are only used from a single thread, every call compiles away */
+class null_lock final
+{
+public:
+    void lock()
+    {
+    }
+
+    bool try_lock()
+    {
+        return true;
+    }
+
+    void unlock()
+    {
+    }
+};
+
+
+/*
+ * Hybrid mutex: spins briefly on the assumption the holder is about to leave a short critical
+ * section, then parks on a futex so a long wait doesn't burn a core.
+ * The state is 0 (unlocked), 1 (locked) or 2 (locked, waiters may be parked). Only unlocking
+ * from state 2 pays for a wake-up system call, an uncontended lock/unlock is one CAS and one exchange.
+ * Where futexes are not available, parked waiters yield instead.
+ */
+class adaptive_mutex final
+{
+public:
+    adaptive_mutex()
+        : m_state(unlocked)
+    {
+    }
+
+    void lock()
+    {
+        int state = unlocked;
+        if (m_state.compare_exchange_strong(state, locked, std::memory_order_acquire))
+        {
+            return;
+        }
+
+        for (uint32_t i = 0; i < max_spins; ++i)
+        {
+            cpu_relax();
+
+            state = m_state.load(std::memory_order_relaxed);
+            if ((unlocked == state) &&
+                m_state.compare_exchange_weak(state, locked, std::memory_order_acquire))
+            {
+                return;
+            }
+        }
+
+        // Advertise a waiter from now on, whoever unlocks will wake one of us up
+        while (m_state.exchange(locked_with_waiters, std::memory_order_acquire) != unlocked)
+        {
+            wait(locked_with_waiters);
+        }
+    }
+
+    bool try_lock()
+    {
+        int state = unlocked;
+        return m_state.compare_exchange_strong(state, locked, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        if (m_state.exchange(unlocked, std::memory_order_release) == locked_with_waiters)
+        {
+            wake_one();
+        }
+    }
+
+private:
+    adaptive_mutex(const adaptive_mutex&);
+    adaptive_mutex& operator=(const adaptive_mutex&);
+
+    static constexpr int unlocked = 0;
+    static constexpr int locked = 1;
+    static constexpr int locked_with_waiters = 2;
+    static constexpr uint32_t max_spins = 100;
+
+    void wait(int expected_state)
+    {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<int*>(&m_state), FUTEX_WAIT_PRIVATE, expected_state, nullptr, nullptr, 0);
+#else
+        if (m_state.load(std::memory_order_relaxed) == expected_state)
+        {
+            std::this_thread::yield();
+        }
+#endif
+    }
+
+    void wake_one()
+    {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<int*>(&m_state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+
+    static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex word must be a plain int!");
+
+    std::atomic<int> m_state;
+};
+
+#endif // LOCKS_H
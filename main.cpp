@@ -1,17 +1,23 @@
 #include "background_task_executor.h"
+#include "alloc_trace.h"
 #include "custom_allocator.h"
 #include "mem_pool.h"
 #include "dynamic_safe_queue.h"
+#include "typed_queue.h"
 #include "peterson's_algo_for_n_process.h"
 #include "safe_malloc_free.h"
+#include "safe_handle_table.h"
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <iostream>
 #include <thread>
 #include <mutex>
 
 
 
 #define SIZE (1024*1024)
+#define PETERSON_ITERATIONS (1000)
 uint8_t lmem[SIZE] = { 0 };
 
 
@@ -121,6 +127,52 @@ int main()
         mp.free(ptr);
     }
 
+    {
+        memory_pool<std::allocator<uint8_t>, adaptive_mutex> mp(SIZE);
+        void* ptr = mp.malloc(1024, 64);
+        mp.free(ptr);
+    }
+
+    {
+        memory_pool<std::allocator<uint8_t>, null_lock> mp(SIZE);
+        void* ptr = mp.malloc(1024);
+        mp.free(ptr);
+    }
+
+    // memory_pool heap walk
+    {
+        memory_pool<> mp(SIZE);
+        void* ptr1 = mp.malloc(100);
+        void* ptr2 = mp.malloc(200);
+        void* ptr3 = mp.malloc(300);
+        mp.free(ptr2);
+
+        memory_pool_heap_stats_s stats = mp.heap_stats();
+        printf("memory_pool: %zu used blocks, %zu free blocks, largest free block %zu, fragmentation %.3f\n",
+            stats.used_blocks, stats.free_blocks, stats.largest_free_block, stats.fragmentation);
+
+        mp.free(ptr1);
+        mp.free(ptr3);
+    }
+
+#ifdef UTILS_ENABLE_ALLOC_TRACE
+    // Allocation tracing, the dump lands in the working directory
+    {
+        alloc_tracer::get_instance()->enable(true);
+        {
+            alloc_trace_dumper dumper("alloc_trace.csv", std::chrono::milliseconds(100));
+            alloc_trace_scope scope("main");
+
+            memory_pool<custom_allocator<uint8_t>> mp(SIZE);
+            void* ptr = mp.malloc(64);
+            mp.free(ptr);
+
+            mp.malloc(32); // Reported as a leak when mp is destroyed
+        }
+        alloc_tracer::get_instance()->enable(false);
+    }
+#endif
+
     // Safe Malloc Free
     {
         auto wptr1 = safe_malloc(10);
@@ -147,6 +199,32 @@ int main()
     }
 
 
+    // Safe Handle Table
+    {
+        safe_handle_t handle = safe_alloc(10);
+
+        {
+            // The payload can't be reclaimed while the guard is alive, even if another thread frees the handle
+            safe_handle_table<>::guard read_guard(epoch_domain::global_domain());
+            if (void* ptr = safe_resolve(handle))
+            {
+                memset(ptr, 0, 10);
+            }
+        }
+
+        safe_free(handle);
+
+        if (void* ptr = safe_resolve(handle)) // Stale handle, resolves to nullptr
+        {
+            memset(ptr, 0, 10);
+        }
+
+        safe_free(handle);
+
+        // The executor's worker hands its reclamation record back only when it exits, during static destruction
+        background_task_executor::get_instance()->add_task([]() { safe_free(safe_alloc(16)); });
+    }
+
     // Safe Queue
     queue_handler_s queue_handler = {};
 
@@ -167,13 +245,80 @@ int main()
     dynamic_safe_queue::get_instance()->dequeue(&queue_handler, item, sizeof(item), &actual_item_size_in_bytes);
     dynamic_safe_queue::get_instance()->dequeue(&queue_handler, item, sizeof(item), &actual_item_size_in_bytes);
 
+    queue_stats_snapshot_s queue_stats = dynamic_safe_queue::get_instance()->snapshot(&queue_handler);
+    std::cout << "enqueued: " << queue_stats.enqueued_items << " dequeued: " << queue_stats.dequeued_items
+              << " empty dequeues: " << queue_stats.empty_dequeues << std::endl;
+
+    dynamic_safe_queue::get_instance()->destroy_queue(&queue_handler);
+
+    // Growing Safe Queue
+    {
+        queue_handler_s growing_queue_handler = {};
+        queue_growth_policy_s growth_policy = {};
+        growth_policy.max_queue_size_in_bytes = 1024;
+        growth_policy.growth_factor = 2;
+        growth_policy.shrink_occupancy_percent = 25;
+        growth_policy.shrink_after_dequeues = 8;
+
+        dynamic_safe_queue::get_instance()->init_queue(&growing_queue_handler, 16, growth_policy);
+
+        for (int i = 0; i < 64; ++i)
+        {
+            dynamic_safe_queue::get_instance()->enqueue(&growing_queue_handler, item, sizeof(item));
+        }
+
+        while (dynamic_safe_queue::get_instance()->dequeue(&growing_queue_handler, item, sizeof(item), &actual_item_size_in_bytes))
+        {
+        }
+
+        dynamic_safe_queue::get_instance()->destroy_queue(&growing_queue_handler);
+    }
+
+
+    // Spilling Safe Queue
+    {
+        queue_handler_s spilling_queue_handler = {};
+        queue_growth_policy_s growth_policy = {};
+        queue_spill_policy_s spill_policy = {};
+        spill_policy.segment_file_path = "safe_queue_spill.seg";
+        spill_policy.segment_size_in_bytes = 4096;
+
+        dynamic_safe_queue::get_instance()->init_queue(&spilling_queue_handler, 16, growth_policy, spill_policy);
+
+        for (int i = 0; i < 64; ++i)
+        {
+            dynamic_safe_queue::get_instance()->enqueue(&spilling_queue_handler, item, sizeof(item));
+        }
+
+        while (dynamic_safe_queue::get_instance()->dequeue(&spilling_queue_handler, item, sizeof(item), &actual_item_size_in_bytes))
+        {
+        }
+
+        dynamic_safe_queue::get_instance()->destroy_queue(&spilling_queue_handler);
+    }
+
+
+    // Typed Queue
+    {
+        typed_queue<uint64_t, 16, spsc_policy> spsc_queue;
+        typed_queue<uint64_t, 16, mpmc_policy> mpmc_queue;
+
+        uint64_t value = 0;
+        spsc_queue.push(1);
+        spsc_queue.pop(value);
+        mpmc_queue.push(value);
+        mpmc_queue.pop(value);
+    }
+
 
     // Peterson's algo for n process
-    std::thread t11([]() { while (1) { cpu0(); } });
-    std::thread t22([]() { while (1) { cpu1(); } });
-    std::thread t33([]() { while (1) { cpu2(); } });
-    
+    std::thread t11([]() { for (int i = 0; i < PETERSON_ITERATIONS; ++i) { cpu0(); } });
+    std::thread t22([]() { for (int i = 0; i < PETERSON_ITERATIONS; ++i) { cpu1(); } });
+    std::thread t33([]() { for (int i = 0; i < PETERSON_ITERATIONS; ++i) { cpu2(); } });
+
     t11.join();
-    
+    t22.join();
+    t33.join();
+
     return 0;
 }
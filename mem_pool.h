@@ -8,9 +8,26 @@
 #include <exception>
 #endif
 #include <mutex>
+#include <type_traits>
 
+#include "alloc_trace.h"
+#include "locks.h"
 
-template<typename _Alloc = std::allocator<uint8_t>>
+
+/* Result of a memory_pool heap walk, sizes exclude the block metadata */
+typedef struct
+{
+    size_t free_blocks;
+    size_t used_blocks;
+    size_t free_bytes;
+    size_t used_bytes;
+    size_t largest_free_block;
+    double fragmentation; /* 1 - largest_free_block / free_bytes, 0 when the free memory is one block */
+} memory_pool_heap_stats_s;
+
+
+/* _Lock is any Lockable (std::mutex, adaptive_mutex, null_lock for single-threaded pools, ...) */
+template<typename _Alloc = std::allocator<uint8_t>, typename _Lock = std::mutex>
 class memory_pool
 {
 public:
@@ -52,6 +69,13 @@ public:
 
     virtual ~memory_pool()
     {
+#ifdef UTILS_ENABLE_ALLOC_TRACE
+        if (alloc_tracer::get_instance()->enabled())
+        {
+            report_leaks();
+        }
+#endif
+
         if (m_free_mem)
         {
             m_allocator.deallocate((uint8_t*)m_free_list, m_mem_pool_size);
@@ -64,7 +88,7 @@ public:
 
     void* malloc(size_t size, size_t align_val = 0)
     {
-        std::lock_guard<std::mutex> lock(m_mtx);
+        std::lock_guard<_Lock> lock(m_mtx);
 
         void* ptr = nullptr;
 
@@ -73,21 +97,22 @@ public:
             size_t total_size = size + align_val;
             block_s* curr = m_free_list;
 
-            while ((((curr->size) < total_size) || (!(curr->free))) && (curr->next != nullptr))
+            // First fit: the first free block that is large enough, wherever it is in the list
+            while (curr && ((!(curr->free)) || ((curr->size) < total_size)))
             {
                 curr = curr->next;
             }
 
-            if ((curr->size) == total_size) // Exact fitting block allocated
+            if (curr && ((curr->size) > (total_size + sizeof(block_s)))) // Fitting block allocated with a split
             {
                 curr->align_offset_placeholder = 0;
-                curr->free = 0;
+                split(curr, total_size);
                 ptr = (void*)(++curr);
             }
-            else if ((curr->size) > (total_size + sizeof(block_s))) // Fitting block allocated with a split
+            else if (curr) // The whole block is allocated, what's left over is too small to become a block of its own
             {
                 curr->align_offset_placeholder = 0;
-                split(curr, total_size);
+                curr->free = 0;
                 ptr = (void*)(++curr);
             }
             else // No sufficient memory to allocate
@@ -100,13 +125,18 @@ public:
                 ptr = align(ptr, align_val);
             }
         }
+
+        if (ptr)
+        {
+            ALLOC_TRACE_EVENT(alloc_trace_event_type::alloc, alloc_trace_source::memory_pool, ptr, size, align_val);
+        }
         
         return ptr;
     }
 
     void free(void* ptr)
     {
-        std::lock_guard<std::mutex> lock(m_mtx);
+        std::lock_guard<_Lock> lock(m_mtx);
 
         if (m_free_list && ptr)
         {
@@ -118,14 +148,50 @@ public:
                     block_s* curr = (block_s*)((uint8_t*)ptr - *align_offset_placeholder_p);
                     --curr;
                     curr->free = 1;
+                    ALLOC_TRACE_EVENT(alloc_trace_event_type::free, alloc_trace_source::memory_pool, ptr, curr->size, 0);
                     merge();
                 }
             }
         }
     }
 
+    /* Calls visitor(const void* block, size_t size, bool free) for every block, in address order */
+    template<typename _Visitor>
+    void walk_heap(_Visitor&& visitor)
+    {
+        std::lock_guard<_Lock> lock(m_mtx);
+        walk_blocks(visitor);
+    }
+
+    memory_pool_heap_stats_s heap_stats()
+    {
+        memory_pool_heap_stats_s stats = {};
+        walk_heap([&](const void*, size_t size, bool free)
+            {
+                if (free)
+                {
+                    ++(stats.free_blocks);
+                    stats.free_bytes += size;
+                    stats.largest_free_block = (size > stats.largest_free_block) ? size : stats.largest_free_block;
+                }
+                else
+                {
+                    ++(stats.used_blocks);
+                    stats.used_bytes += size;
+                }
+            });
+
+        if (stats.free_bytes != 0)
+        {
+            stats.fragmentation = 1.0 - ((double)stats.largest_free_block / (double)stats.free_bytes);
+        }
+
+        return stats;
+    }
+
 private:
-    static_assert(std::is_same<_Alloc::value_type, uint8_t>::value, "allocator type must be uint8_t!");
+    static_assert(std::is_same<typename _Alloc::value_type, uint8_t>::value, "allocator type must be uint8_t!");
+    static_assert(is_lockable<_Lock>::value, "lock type must implement lock/try_lock/unlock!");
 
     /* The structure definition to contain metadata of each block allocated or deallocated */
 #pragma pack(push, 1)
@@ -139,10 +205,32 @@ private:
 
     block_s* m_free_list;
     size_t m_mem_pool_size;
-    std::mutex m_mtx;
+    _Lock m_mtx;
     bool m_free_mem;
     _Alloc m_allocator;
 
+    template<typename _Visitor>
+    void walk_blocks(_Visitor& visitor)
+    {
+        for (block_s* curr = m_free_list; curr != nullptr; curr = curr->next)
+        {
+            visitor((const void*)(curr + 1), curr->size, (curr->free != 0));
+        }
+    }
+
+    void report_leaks()
+    {
+        auto report_used_block = [&](const void* block, size_t size, bool free)
+            {
+                if (!free)
+                {
+                    alloc_tracer::get_instance()->report_leak(this, block, size);
+                }
+            };
+
+        walk_blocks(report_used_block);
+    }
+
     void init(void* mem_pool, size_t mem_pool_size)
     {
         m_mem_pool_size = mem_pool_size;
@@ -227,4 +315,68 @@ private:
 };
 
 
+/* std compatible allocator drawing from a memory_pool, e.g. to co-allocate safe_malloc blocks from a pool */
+template<typename T, typename _Pool = memory_pool<>>
+class memory_pool_allocator
+{
+public:
+    typedef T value_type;
+
+    template <typename U> struct rebind
+    {
+        typedef memory_pool_allocator<U, _Pool> other;
+    };
+
+    explicit memory_pool_allocator(_Pool& pool)
+        : m_pool(&pool)
+    {
+    }
+
+    template <typename U> memory_pool_allocator(const memory_pool_allocator<U, _Pool>& other)
+        : m_pool(other.pool())
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        T* x = (T*)m_pool->malloc(n * sizeof(T), alignof(T));
+        if (x == nullptr)
+        {
+#ifdef __EXCEPTIONS
+            throw(std::bad_alloc());
+#else
+            return nullptr;
+#endif
+        }
+
+        return x;
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        m_pool->free(p);
+    }
+
+    _Pool* pool() const
+    {
+        return m_pool;
+    }
+
+    template <typename U>
+    bool operator==(const memory_pool_allocator<U, _Pool>& other) const
+    {
+        return m_pool == other.pool();
+    }
+
+    template <typename U>
+    bool operator!=(const memory_pool_allocator<U, _Pool>& other) const
+    {
+        return m_pool != other.pool();
+    }
+
+private:
+    _Pool* m_pool;
+};
+
+
 #endif
\ No newline at end of file
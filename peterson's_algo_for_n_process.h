@@ -1,38 +1,26 @@
 #ifndef LOCK_FREE_CRITICAL_SECTION_H
 #define LOCK_FREE_CRITICAL_SECTION_H
 
-#define TRUE 1
-#define FALSE 0
-#define N 3 // Number of processes
+#include "locks.h"
 
-int turn[N];
-int flags[N];
+// Number of processes
+constexpr size_t peterson_num_of_processes = 3;
 
-void enter_critical_section(int curr_process_id) {
-    for (int count = 0; count < (N - 1); count++) {
-        flags[curr_process_id] = count;                 // I think I'm in position "count" in the queue
-        turn[count] = curr_process_id;                  // and I'm the most recent process to think I'm in position "count"
-
-        // wait until
-        // everyone thinks they're behind me 
-        // or someone later than me thinks they're in position "count"
-        for (int k = 0; k < N; k++)
-        {
-            while (((k == curr_process_id) || (flags[k] >= count)) &&
-                (turn[count] == curr_process_id))
-            {
-                // Busy wait
-            }
-            // now I can update my estimated position to "count"+1
-        }
+// The filter lock in locks.h uses sequentially consistent atomics, the plain ints this used to
+// spin on gave no ordering guarantees on x86/ARM, and it backs off instead of burning a core
+inline filter_lock<peterson_num_of_processes>& peterson_filter_lock()
+{
+    static filter_lock<peterson_num_of_processes> lock;
+    return lock;
+}
 
-        // now I'm at the head of the queue so I can start my critical section
-    }
+inline void enter_critical_section(int curr_process_id) {
+    peterson_filter_lock().lock((size_t)curr_process_id);
 }
 
-void leave_critical_section(int curr_process_id) {
+inline void leave_critical_section(int curr_process_id) {
     // Remove interest in entering the critical section
-    flags[curr_process_id] = -1;
+    peterson_filter_lock().unlock((size_t)curr_process_id);
 }
 
 #endif
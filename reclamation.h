@@ -0,0 +1,589 @@
+#ifndef RECLAMATION_H
+#define RECLAMATION_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __EXCEPTIONS
+#include <stdexcept>
+#endif
+
+#include "locks.h"
+
+
+/* Memory handed to a reclamation domain, freed by calling reclaim once no reader can still see it */
+typedef struct
+{
+    void*    ptr;
+    size_t   size;
+    void   (*reclaim)(void* context, void* ptr, size_t size);
+    void*    context;
+    uint64_t epoch; /* Global epoch at retire time (epoch_domain only) */
+} retired_s;
+
+
+/* Common part of the per-thread records kept by every domain */
+struct reclamation_record_s
+{
+    std::atomic<bool>      in_use;
+    reclamation_record_s*  next;
+    ttas_lock              retired_lock; /* Only contended while synchronize() or a new owner touches the list */
+    std::vector<retired_s> retired;
+
+    reclamation_record_s()
+        : in_use(true),
+          next(nullptr)
+    {
+    }
+};
+
+
+/*
+ * Per-thread cache of the record a thread owns in each domain. Records are handed back to their
+ * domain when the thread exits (pending retired memory is inherited by the next owner), which is
+ * why a domain must outlive every thread that used it. The global domains are never destroyed for
+ * that reason, threads still running during static destruction (e.g. the background_task_executor
+ * worker) can hand their records back at any point.
+ */
+class reclamation_thread_cache final
+{
+public:
+    static reclamation_thread_cache& instance()
+    {
+        static thread_local reclamation_thread_cache cache;
+        return cache;
+    }
+
+    reclamation_record_s* find(const void* domain) const
+    {
+        for (const entry_s& entry : m_entries)
+        {
+            if (entry.domain == domain)
+            {
+                return entry.record;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void add(const void* domain, reclamation_record_s* record)
+    {
+        m_entries.push_back({ domain, record });
+    }
+
+    /* A static domain is destroyed after the main thread's cache, which must not be touched then */
+    static void remove_from_current_thread(const void* domain)
+    {
+        if (!destroyed())
+        {
+            instance().remove(domain);
+        }
+    }
+
+private:
+    reclamation_thread_cache() { }
+
+    ~reclamation_thread_cache()
+    {
+        for (entry_s& entry : m_entries)
+        {
+            entry.record->in_use.store(false, std::memory_order_release);
+        }
+
+        destroyed() = true;
+    }
+
+    static bool& destroyed()
+    {
+        static thread_local bool cache_destroyed = false;
+        return cache_destroyed;
+    }
+
+    void remove(const void* domain)
+    {
+        for (size_t i = 0; i < m_entries.size(); ++i)
+        {
+            if (m_entries[i].domain == domain)
+            {
+                m_entries.erase(m_entries.begin() + i);
+                return;
+            }
+        }
+    }
+
+    struct entry_s
+    {
+        const void*           domain;
+        reclamation_record_s* record;
+    };
+
+    std::vector<entry_s> m_entries;
+};
+
+
+/* Lock-free, push only list of thread records, released records are reused rather than freed */
+template<typename _Record>
+class reclamation_record_list final
+{
+public:
+    reclamation_record_list()
+        : m_head(nullptr)
+    {
+    }
+
+    ~reclamation_record_list()
+    {
+        _Record* record = m_head.load(std::memory_order_relaxed);
+        while (record)
+        {
+            _Record* next = static_cast<_Record*>(record->next);
+            delete record;
+            record = next;
+        }
+    }
+
+    _Record* local(const void* domain)
+    {
+        reclamation_thread_cache& cache = reclamation_thread_cache::instance();
+
+        _Record* record = static_cast<_Record*>(cache.find(domain));
+        if (!record)
+        {
+            record = acquire();
+            cache.add(domain, record);
+        }
+
+        return record;
+    }
+
+    template<typename _Func>
+    void for_each(_Func func)
+    {
+        for (_Record* record = m_head.load(std::memory_order_acquire); record; record = static_cast<_Record*>(record->next))
+        {
+            func(record);
+        }
+    }
+
+private:
+    reclamation_record_list(const reclamation_record_list&);
+    reclamation_record_list& operator=(const reclamation_record_list&);
+
+    _Record* acquire()
+    {
+        for (_Record* record = m_head.load(std::memory_order_acquire); record; record = static_cast<_Record*>(record->next))
+        {
+            bool in_use = false;
+            if (!record->in_use.load(std::memory_order_relaxed) &&
+                record->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire))
+            {
+                return record;
+            }
+        }
+
+        _Record* record = new _Record();
+        _Record* head = m_head.load(std::memory_order_relaxed);
+        do
+        {
+            record->next = head;
+        } while (!m_head.compare_exchange_weak(head, record, std::memory_order_release, std::memory_order_relaxed));
+
+        return record;
+    }
+
+    std::atomic<_Record*> m_head;
+};
+
+
+/* Calls reclaim on the retired entries selected by is_reclaimable, outside the record lock */
+template<typename _Pred>
+inline void reclaim_retired(reclamation_record_s* record, _Pred is_reclaimable)
+{
+    std::vector<retired_s> reclaimable;
+    {
+        std::lock_guard<ttas_lock> lock(record->retired_lock);
+
+        std::vector<retired_s>::iterator it = std::stable_partition(record->retired.begin(), record->retired.end(),
+            [&](const retired_s& retired) { return !is_reclaimable(retired); });
+
+        reclaimable.assign(it, record->retired.end());
+        record->retired.erase(it, record->retired.end());
+    }
+
+    for (retired_s& retired : reclaimable)
+    {
+        retired.reclaim(retired.context, retired.ptr, retired.size);
+    }
+}
+
+
+/*
+ * Epoch-based reclamation. Readers enter a critical region (a guard) by announcing the global
+ * epoch, which costs a store and a fence instead of a refcount round trip per access. Memory
+ * retired during epoch e is freed in batches once the global epoch reached e + 2, which can only
+ * happen after every reader that could still see it has left its region.
+ */
+class epoch_domain final
+{
+public:
+    class guard final
+    {
+    public:
+        explicit guard(epoch_domain& domain)
+            : m_domain(domain)
+        {
+            m_domain.enter();
+        }
+
+        ~guard()
+        {
+            m_domain.exit();
+        }
+
+        /* Nothing to publish, being inside the region already protects everything reachable */
+        void protect(const void*)
+        {
+        }
+
+    private:
+        guard(const guard&);
+        guard& operator=(const guard&);
+
+        epoch_domain& m_domain;
+    };
+
+    epoch_domain()
+        : m_epoch(quiescent_epoch + 1)
+    {
+    }
+
+    /* No reader may be left, so everything still retired is freed */
+    ~epoch_domain()
+    {
+        m_records.for_each([](epoch_record_s* record) {
+            reclaim_retired(record, [](const retired_s&) { return true; });
+            });
+
+        reclamation_thread_cache::remove_from_current_thread(this);
+    }
+
+    /* Never destroyed, see reclamation_thread_cache */
+    static epoch_domain& global_domain()
+    {
+        static epoch_domain* domain = new epoch_domain();
+        return *domain;
+    }
+
+    void enter()
+    {
+        epoch_record_s* record = m_records.local(this);
+        if (0 == (record->nesting)++)
+        {
+            uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+            record->epoch.store(epoch, std::memory_order_relaxed);
+
+            // The announcement must be visible before any load made inside the region
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void exit()
+    {
+        epoch_record_s* record = m_records.local(this);
+        if (0 == --(record->nesting))
+        {
+            record->epoch.store(quiescent_epoch, std::memory_order_release);
+        }
+    }
+
+    void retire(void* ptr, size_t size, void (*reclaim)(void* context, void* ptr, size_t size), void* context)
+    {
+        epoch_record_s* record = m_records.local(this);
+
+        size_t num_of_retired = 0;
+        {
+            std::lock_guard<ttas_lock> lock(record->retired_lock);
+            record->retired.push_back({ ptr, size, reclaim, context, m_epoch.load(std::memory_order_acquire) });
+            num_of_retired = record->retired.size();
+        }
+
+        if (num_of_retired >= reclaim_threshold)
+        {
+            try_advance();
+            reclaim_up_to(record, m_epoch.load(std::memory_order_acquire));
+        }
+    }
+
+    template<typename T>
+    void retire(T* ptr)
+    {
+        retire(ptr, sizeof(T), [](void*, void* p, size_t) { delete (T*)p; }, nullptr);
+    }
+
+    /* Waits for every reader to leave its region and frees everything retired so far, must be called outside a region */
+    void synchronize()
+    {
+        uint64_t target_epoch = m_epoch.load(std::memory_order_acquire) + 2;
+
+        exponential_backoff backoff;
+        while (m_epoch.load(std::memory_order_acquire) < target_epoch)
+        {
+            if (!try_advance())
+            {
+                backoff.pause();
+            }
+        }
+
+        uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+        m_records.for_each([&](epoch_record_s* record) { reclaim_up_to(record, epoch); });
+    }
+
+private:
+    epoch_domain(const epoch_domain&);
+    epoch_domain& operator=(const epoch_domain&);
+
+    static constexpr uint64_t quiescent_epoch = 0;
+    static constexpr size_t   reclaim_threshold = 64;
+
+    struct epoch_record_s : reclamation_record_s
+    {
+        std::atomic<uint64_t> epoch;   /* Announced epoch, quiescent_epoch outside a region */
+        uint32_t              nesting; /* Only accessed by the owning thread */
+
+        epoch_record_s()
+            : epoch(quiescent_epoch),
+              nesting(0)
+        {
+        }
+    };
+
+    /* The global epoch can only move on once every reader inside a region announced it */
+    bool try_advance()
+    {
+        uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool all_caught_up = true;
+        m_records.for_each([&](epoch_record_s* record) {
+            uint64_t record_epoch = record->epoch.load(std::memory_order_acquire);
+            if ((record_epoch != quiescent_epoch) && (record_epoch != epoch))
+            {
+                all_caught_up = false;
+            }
+            });
+
+        if (!all_caught_up)
+        {
+            return false;
+        }
+
+        // Losing the race is fine, someone else moved the epoch on
+        uint64_t expected_epoch = epoch;
+        return m_epoch.compare_exchange_strong(expected_epoch, epoch + 1, std::memory_order_acq_rel) ||
+               (expected_epoch > epoch);
+    }
+
+    void reclaim_up_to(epoch_record_s* record, uint64_t epoch)
+    {
+        reclaim_retired(record, [epoch](const retired_s& retired) { return (retired.epoch + 2) <= epoch; });
+    }
+
+    std::atomic<uint64_t>                   m_epoch;
+    reclamation_record_list<epoch_record_s> m_records;
+};
+
+
+/*
+ * Hazard pointer reclamation. A reader publishes the pointer it is about to use in one of its
+ * hazard slots and then validates that it is still reachable. Retired memory is freed once no
+ * hazard slot holds it. Compared to epoch_domain a stalled reader only pins what it protects,
+ * at the cost of a fence per protected pointer.
+ */
+class hazard_pointer_domain final
+{
+private:
+    struct hazard_record_s;
+
+public:
+    static constexpr size_t hazards_per_thread = 4;
+
+    class guard final
+    {
+    public:
+        /* At most hazards_per_thread guards of one domain can be alive on a thread */
+        explicit guard(hazard_pointer_domain& domain)
+            : m_record(domain.m_records.local(&domain))
+        {
+            if (m_record->num_of_used_hazards == hazards_per_thread)
+            {
+#ifdef __EXCEPTIONS
+                throw(std::length_error("hazard_pointer_domain: every hazard slot of the thread is in use"));
+#else
+                std::abort();
+#endif
+            }
+
+            m_hazard = &(m_record->hazards[m_record->num_of_used_hazards++]);
+        }
+
+        ~guard()
+        {
+            m_hazard->store(nullptr, std::memory_order_release);
+            --(m_record->num_of_used_hazards);
+        }
+
+        /* The caller must check that ptr is still reachable after this returns */
+        void protect(const void* ptr)
+        {
+            m_hazard->store(const_cast<void*>(ptr), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        template<typename T>
+        T* protect(const std::atomic<T*>& src)
+        {
+            T* ptr = src.load(std::memory_order_relaxed);
+            while (true)
+            {
+                protect(ptr);
+
+                T* current_ptr = src.load(std::memory_order_acquire);
+                if (current_ptr == ptr)
+                {
+                    return ptr;
+                }
+
+                ptr = current_ptr;
+            }
+        }
+
+    private:
+        guard(const guard&);
+        guard& operator=(const guard&);
+
+        hazard_record_s*    m_record;
+        std::atomic<void*>* m_hazard;
+    };
+
+    hazard_pointer_domain() { }
+
+    /* No reader may be left, so everything still retired is freed */
+    ~hazard_pointer_domain()
+    {
+        m_records.for_each([](hazard_record_s* record) {
+            reclaim_retired(record, [](const retired_s&) { return true; });
+            });
+
+        reclamation_thread_cache::remove_from_current_thread(this);
+    }
+
+    /* Never destroyed, see reclamation_thread_cache */
+    static hazard_pointer_domain& global_domain()
+    {
+        static hazard_pointer_domain* domain = new hazard_pointer_domain();
+        return *domain;
+    }
+
+    void retire(void* ptr, size_t size, void (*reclaim)(void* context, void* ptr, size_t size), void* context)
+    {
+        hazard_record_s* record = m_records.local(this);
+
+        size_t num_of_retired = 0;
+        {
+            std::lock_guard<ttas_lock> lock(record->retired_lock);
+            record->retired.push_back({ ptr, size, reclaim, context, 0 });
+            num_of_retired = record->retired.size();
+        }
+
+        if (num_of_retired >= reclaim_threshold)
+        {
+            scan(record);
+        }
+    }
+
+    template<typename T>
+    void retire(T* ptr)
+    {
+        retire(ptr, sizeof(T), [](void*, void* p, size_t) { delete (T*)p; }, nullptr);
+    }
+
+    /* Frees everything retired so far, waiting for the readers still protecting some of it */
+    void synchronize()
+    {
+        exponential_backoff backoff;
+        while (true)
+        {
+            bool all_reclaimed = true;
+            m_records.for_each([&](hazard_record_s* record) {
+                scan(record);
+
+                std::lock_guard<ttas_lock> lock(record->retired_lock);
+                all_reclaimed = all_reclaimed && record->retired.empty();
+                });
+
+            if (all_reclaimed)
+            {
+                return;
+            }
+
+            backoff.pause();
+        }
+    }
+
+private:
+    hazard_pointer_domain(const hazard_pointer_domain&);
+    hazard_pointer_domain& operator=(const hazard_pointer_domain&);
+
+    static constexpr size_t reclaim_threshold = 64;
+
+    struct hazard_record_s : reclamation_record_s
+    {
+        std::atomic<void*> hazards[hazards_per_thread];
+        size_t             num_of_used_hazards; /* Only accessed by the owning thread */
+
+        hazard_record_s()
+            : num_of_used_hazards(0)
+        {
+            for (size_t i = 0; i < hazards_per_thread; ++i)
+            {
+                hazards[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    void scan(hazard_record_s* record)
+    {
+        // Pairs with the fence in guard::protect, either the reader sees the memory unreachable or we see its hazard
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        std::vector<void*> hazards;
+        m_records.for_each([&](hazard_record_s* hazard_record) {
+            for (size_t i = 0; i < hazards_per_thread; ++i)
+            {
+                void* hazard = hazard_record->hazards[i].load(std::memory_order_acquire);
+                if (hazard)
+                {
+                    hazards.push_back(hazard);
+                }
+            }
+            });
+
+        std::sort(hazards.begin(), hazards.end());
+
+        reclaim_retired(record, [&](const retired_s& retired) {
+            return !std::binary_search(hazards.begin(), hazards.end(), retired.ptr);
+            });
+    }
+
+    reclamation_record_list<hazard_record_s> m_records;
+};
+
+#endif // RECLAMATION_H
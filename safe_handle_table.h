@@ -0,0 +1,301 @@
+#ifndef SAFE_HANDLE_TABLE_H
+#define SAFE_HANDLE_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "locks.h"
+#include "reclamation.h"
+
+
+/* 64-bit handle: slot index in the low 32 bits, slot generation in the high 32 bits. 0 is never valid. */
+typedef uint64_t safe_handle_t;
+
+constexpr safe_handle_t invalid_safe_handle = 0;
+
+
+/*
+ * Generational slot map, a low overhead alternative to safe_malloc's weak_ptr.
+ * resolve() is a bounds check and a generation compare made of plain loads, no refcount is
+ * touched. free() bumps the slot generation, so stale handles resolve to nullptr instead of
+ * dangling.
+ *
+ * Slots live in fixed size chunks that are never moved, so the table can grow while readers
+ * resolve handles. Only alloc() and free() take the lock.
+ *
+ * free() retires the payload into a reclamation domain (_Reclaimer) instead of releasing it, so
+ * a reader that resolved a handle inside a _Reclaimer::guard can keep using the pointer until
+ * the guard goes away, even if the handle is freed meanwhile.
+ */
+template<typename _Alloc = std::allocator<uint8_t>, typename _Lock = std::mutex, typename _Reclaimer = epoch_domain>
+class safe_handle_table final
+{
+public:
+    typedef typename _Reclaimer::guard guard;
+
+    explicit safe_handle_table(const _Alloc& allocator = _Alloc(), _Reclaimer& reclaimer = _Reclaimer::global_domain())
+        : m_num_of_slots(0),
+          m_free_head(end_of_free_list),
+          m_allocator(allocator),
+          m_reclaimer(&reclaimer)
+    {
+        for (size_t i = 0; i < max_chunks; ++i)
+        {
+            m_chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~safe_handle_table()
+    {
+        // Payloads retired earlier still point back at this table
+        m_reclaimer->synchronize();
+
+        uint32_t num_of_slots = m_num_of_slots.load(std::memory_order_relaxed);
+        for (uint32_t index = 0; index < num_of_slots; ++index)
+        {
+            slot_s& slot = slot_at(index);
+            void* ptr = slot.ptr.load(std::memory_order_relaxed);
+            if (ptr)
+            {
+                m_allocator.deallocate((uint8_t*)ptr, slot.size);
+            }
+        }
+
+        for (size_t i = 0; i < max_chunks; ++i)
+        {
+            delete[] m_chunks[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    safe_handle_t alloc(size_t size)
+    {
+        if (0 == size)
+        {
+            return invalid_safe_handle;
+        }
+
+        void* ptr = m_allocator.allocate(size);
+        if (!ptr)
+        {
+            return invalid_safe_handle;
+        }
+
+        std::lock_guard<_Lock> lock(m_mtx);
+
+        uint32_t index = m_free_head;
+        if (end_of_free_list == index)
+        {
+            if (!add_slot(index))
+            {
+                m_allocator.deallocate((uint8_t*)ptr, size);
+                return invalid_safe_handle;
+            }
+        }
+        else
+        {
+            m_free_head = slot_at(index).next_free;
+        }
+
+        slot_s& slot = slot_at(index);
+        slot.size = size;
+
+        // Publishing the pointer with release lets a reader that sees it also see the bumped generation
+        slot.ptr.store(ptr, std::memory_order_release);
+
+        return make_handle(index, slot.generation.load(std::memory_order_relaxed));
+    }
+
+    void* resolve(safe_handle_t handle) const
+    {
+        uint32_t index = handle_index(handle);
+        uint32_t generation = handle_generation(handle);
+
+        if (index >= m_num_of_slots.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+
+        const slot_s& slot = slot_at(index);
+        if (slot.generation.load(std::memory_order_acquire) != generation)
+        {
+            return nullptr;
+        }
+
+        void* ptr = slot.ptr.load(std::memory_order_acquire);
+
+        // The slot may have been freed and reused between the two loads
+        if (slot.generation.load(std::memory_order_relaxed) != generation)
+        {
+            return nullptr;
+        }
+
+        return ptr;
+    }
+
+    /* Resolves and protects the payload for as long as guard lives, works with any _Reclaimer */
+    void* resolve(safe_handle_t handle, guard& read_guard) const
+    {
+        void* ptr = resolve(handle);
+        if (!ptr)
+        {
+            return nullptr;
+        }
+
+        read_guard.protect(ptr);
+
+        // Make sure the handle wasn't freed before the protection became visible
+        return (resolve(handle) == ptr) ? ptr : nullptr;
+    }
+
+    bool free(safe_handle_t handle)
+    {
+        uint32_t index = handle_index(handle);
+        uint32_t generation = handle_generation(handle);
+
+        void* ptr = nullptr;
+        size_t size = 0;
+        {
+            std::lock_guard<_Lock> lock(m_mtx);
+
+            if (index >= m_num_of_slots.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+
+            slot_s& slot = slot_at(index);
+            if (slot.generation.load(std::memory_order_relaxed) != generation)
+            {
+                return false; // Stale handle, already freed
+            }
+
+            ptr = slot.ptr.load(std::memory_order_relaxed);
+            size = slot.size;
+
+            slot.generation.store(next_generation(generation), std::memory_order_release);
+            slot.ptr.store(nullptr, std::memory_order_relaxed);
+            slot.next_free = m_free_head;
+            m_free_head = index;
+        }
+
+        m_reclaimer->retire(ptr, size, &reclaim_payload, this);
+        return true;
+    }
+
+private:
+    static_assert(std::is_same<typename _Alloc::value_type, uint8_t>::value, "allocator type must be uint8_t!");
+    static_assert(is_lockable<_Lock>::value, "lock type must implement lock/try_lock/unlock!");
+
+    safe_handle_table(const safe_handle_table&);
+    safe_handle_table& operator=(const safe_handle_table&);
+
+    static constexpr uint32_t chunk_shift = 10;
+    static constexpr uint32_t chunk_size = 1u << chunk_shift;
+    static constexpr size_t   max_chunks = 4096;
+    static constexpr uint32_t end_of_free_list = UINT32_MAX;
+
+    struct slot_s
+    {
+        std::atomic<uint32_t> generation;
+        uint32_t              next_free; /* Only accessed under the lock */
+        std::atomic<void*>    ptr;
+        size_t                size;      /* Only accessed under the lock */
+    };
+
+    static void reclaim_payload(void* context, void* ptr, size_t size)
+    {
+        ((safe_handle_table*)context)->m_allocator.deallocate((uint8_t*)ptr, size);
+    }
+
+    static safe_handle_t make_handle(uint32_t index, uint32_t generation)
+    {
+        return ((safe_handle_t)generation << 32) | index;
+    }
+
+    static uint32_t handle_index(safe_handle_t handle)
+    {
+        return (uint32_t)(handle & UINT32_MAX);
+    }
+
+    static uint32_t handle_generation(safe_handle_t handle)
+    {
+        return (uint32_t)(handle >> 32);
+    }
+
+    /* Generation 0 is skipped on wrap around so that invalid_safe_handle never resolves */
+    static uint32_t next_generation(uint32_t generation)
+    {
+        return (generation == UINT32_MAX) ? 1 : (generation + 1);
+    }
+
+    slot_s& slot_at(uint32_t index) const
+    {
+        return m_chunks[index >> chunk_shift].load(std::memory_order_acquire)[index & (chunk_size - 1)];
+    }
+
+    bool add_slot(uint32_t& index)
+    {
+        index = m_num_of_slots.load(std::memory_order_relaxed);
+        size_t chunk_index = index >> chunk_shift;
+        if (chunk_index >= max_chunks)
+        {
+            return false;
+        }
+
+        if (!m_chunks[chunk_index].load(std::memory_order_relaxed))
+        {
+            slot_s* chunk = new (std::nothrow) slot_s[chunk_size];
+            if (!chunk)
+            {
+                return false;
+            }
+
+            for (uint32_t i = 0; i < chunk_size; ++i)
+            {
+                chunk[i].generation.store(1, std::memory_order_relaxed);
+                chunk[i].next_free = end_of_free_list;
+                chunk[i].ptr.store(nullptr, std::memory_order_relaxed);
+                chunk[i].size = 0;
+            }
+
+            m_chunks[chunk_index].store(chunk, std::memory_order_release);
+        }
+
+        m_num_of_slots.store(index + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::atomic<slot_s*>  m_chunks[max_chunks];
+    std::atomic<uint32_t> m_num_of_slots;
+    uint32_t              m_free_head; /* Only accessed under the lock */
+    _Lock                 m_mtx;
+    _Alloc                m_allocator;
+    _Reclaimer*           m_reclaimer;
+};
+
+
+inline safe_handle_table<>& default_safe_handle_table()
+{
+    static safe_handle_table<> handle_table;
+    return handle_table;
+}
+
+inline safe_handle_t safe_alloc(size_t size)
+{
+    return default_safe_handle_table().alloc(size);
+}
+
+/* The returned pointer stays valid while the caller is inside a safe_handle_table<>::guard */
+inline void* safe_resolve(safe_handle_t handle)
+{
+    return default_safe_handle_table().resolve(handle);
+}
+
+inline bool safe_free(safe_handle_t handle)
+{
+    return default_safe_handle_table().free(handle);
+}
+
+#endif // SAFE_HANDLE_TABLE_H
@@ -2,35 +2,261 @@
 #define SAFE_MALLOC_FREE_H
 
 
-#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <vector>
 
-static std::unordered_map<void*, std::shared_ptr<void>> shared_ptr_per_address;
+#include "alloc_trace.h"
+#include "locks.h"
+
+
+/*
+ * Registry of the live safe allocations, sharded by address hash so concurrent safe_malloc and
+ * safe_free calls only contend when they land on the same shard. Each shard is an open-addressing
+ * table, so registering an allocation doesn't allocate a node.
+ *
+ * The shared_ptr control block and the payload are co-allocated through _Alloc (allocate_shared),
+ * so every safe allocation is a single allocation, e.g. from a memory_pool through memory_pool_allocator.
+ * The tradeoff is that the combined block is only released once the last weak_ptr to it is gone,
+ * not on release(): memory handed out by safe_malloc stays allocated for as long as any copy of
+ * its weak_ptr is kept around. The payload is not zero-filled, like malloc.
+ */
+template<typename _Alloc = std::allocator<uint8_t>, typename _Lock = std::mutex, size_t NumOfShards = 64>
+class safe_malloc_registry final
+{
+public:
+    explicit safe_malloc_registry(const _Alloc& allocator = _Alloc())
+        : m_allocator(allocator)
+    {
+    }
+
+    std::weak_ptr<void> allocate(size_t size)
+    {
+        if (0 == size)
+        {
+            return {};
+        }
+
+        std::shared_ptr<void> sptr = allocate_shared_block(size);
+        if (!sptr)
+        {
+            return {};
+        }
+
+        ALLOC_TRACE_EVENT(alloc_trace_event_type::alloc, alloc_trace_source::safe_malloc, sptr.get(), size, alignof(std::max_align_t));
+
+        std::weak_ptr<void> wptr = sptr;
+        shard_s& shard = shard_of(sptr.get());
+        {
+            std::lock_guard<_Lock> lock(shard.mtx);
+            insert(shard, std::move(sptr));
+        }
+
+        return wptr;
+    }
+
+    void release(const std::weak_ptr<void>& wptr)
+    {
+        std::shared_ptr<void> sptr = wptr.lock();
+        if (!sptr)
+        {
+            return;
+        }
+
+        std::shared_ptr<void> registered_sptr;
+        shard_s& shard = shard_of(sptr.get());
+        {
+            std::lock_guard<_Lock> lock(shard.mtx);
+            registered_sptr = erase(shard, sptr.get());
+        }
+
+        if (registered_sptr)
+        {
+            ALLOC_TRACE_EVENT(alloc_trace_event_type::free, alloc_trace_source::safe_malloc, sptr.get(), 0, alignof(std::max_align_t));
+        }
+
+        // The payload is destroyed here, outside the shard lock, once the last reader lets go. The
+        // memory block itself is only released when the last weak_ptr to it goes away.
+    }
+
+    size_t size()
+    {
+        size_t num_of_entries = 0;
+        for (shard_s& shard : m_shards)
+        {
+            std::lock_guard<_Lock> lock(shard.mtx);
+            num_of_entries += shard.num_of_entries;
+        }
+
+        return num_of_entries;
+    }
+
+private:
+    static_assert((NumOfShards != 0) && ((NumOfShards & (NumOfShards - 1)) == 0), "number of shards must be a power of two!");
+    static_assert(is_lockable<_Lock>::value, "lock type must implement lock/try_lock/unlock!");
+
+    safe_malloc_registry(const safe_malloc_registry&);
+    safe_malloc_registry& operator=(const safe_malloc_registry&);
+
+    static constexpr size_t initial_shard_capacity = 16;
+
+    struct entry_s
+    {
+        void*                 address; /* nullptr for an empty slot, tombstone() for an erased one */
+        std::shared_ptr<void> sptr;
+    };
+
+    struct alignas(64) shard_s
+    {
+        _Lock                mtx;
+        std::vector<entry_s> table;
+        size_t               num_of_entries = 0;
+        size_t               num_of_tombstones = 0;
+    };
+
+    static void* tombstone()
+    {
+        return (void*)(uintptr_t)1;
+    }
+
+    static uint64_t hash(const void* address)
+    {
+        uint64_t h = (uint64_t)(uintptr_t)address;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    shard_s& shard_of(const void* address)
+    {
+        return m_shards[hash(address) & (NumOfShards - 1)];
+    }
+
+    std::shared_ptr<void> allocate_shared_block(size_t size)
+    {
+#if defined(__cpp_lib_smart_ptr_for_overwrite) && (__cpp_lib_smart_ptr_for_overwrite >= 202002L)
+        // One allocation holding both the control block and a max_align_t aligned, uninitialized payload
+        size_t num_of_elements = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+        std::shared_ptr<std::max_align_t[]> block = std::allocate_shared_for_overwrite<std::max_align_t[]>(m_allocator, num_of_elements);
+        return std::shared_ptr<void>(block, block.get());
+#elif defined(__cpp_lib_shared_ptr_arrays) && (__cpp_lib_shared_ptr_arrays >= 201707L)
+        // Same as above, but the payload gets value-initialized (zero-filled)
+        size_t num_of_elements = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+        std::shared_ptr<std::max_align_t[]> block = std::allocate_shared<std::max_align_t[]>(m_allocator, num_of_elements);
+        return std::shared_ptr<void>(block, block.get());
+#else
+        // Without array support in allocate_shared the payload needs its own allocation
+        typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<std::max_align_t> payload_allocator_t;
+        size_t num_of_elements = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+
+        payload_allocator_t payload_allocator(m_allocator);
+        std::max_align_t* payload = payload_allocator.allocate(num_of_elements);
+        if (!payload)
+        {
+            return {};
+        }
+
+        return std::shared_ptr<void>(payload, [payload_allocator, num_of_elements](void* p) mutable {
+            payload_allocator.deallocate((std::max_align_t*)p, num_of_elements);
+            }, m_allocator);
+#endif
+    }
+
+    void insert(shard_s& shard, std::shared_ptr<void>&& sptr)
+    {
+        if (((shard.num_of_entries + shard.num_of_tombstones + 1) * 4) > (shard.table.size() * 3))
+        {
+            rehash(shard);
+        }
+
+        size_t index_mask = shard.table.size() - 1;
+        size_t index = (size_t)(hash(sptr.get()) / NumOfShards) & index_mask;
+        while ((shard.table[index].address != nullptr) && (shard.table[index].address != tombstone()))
+        {
+            index = (index + 1) & index_mask;
+        }
+
+        if (shard.table[index].address == tombstone())
+        {
+            --(shard.num_of_tombstones);
+        }
+
+        shard.table[index].address = sptr.get();
+        shard.table[index].sptr = std::move(sptr);
+        ++(shard.num_of_entries);
+    }
+
+    std::shared_ptr<void> erase(shard_s& shard, const void* address)
+    {
+        if (shard.table.empty())
+        {
+            return {};
+        }
+
+        size_t index_mask = shard.table.size() - 1;
+        size_t index = (size_t)(hash(address) / NumOfShards) & index_mask;
+        while (shard.table[index].address != nullptr)
+        {
+            if (shard.table[index].address == address)
+            {
+                shard.table[index].address = tombstone();
+                --(shard.num_of_entries);
+                ++(shard.num_of_tombstones);
+                return std::move(shard.table[index].sptr);
+            }
+
+            index = (index + 1) & index_mask;
+        }
 
-std::weak_ptr<void> safe_malloc(size_t size) {
-    void* ptr = malloc(size);
-    if (!ptr) {
         return {};
     }
 
-    // Create a shared_ptr that uses a custom deleter for safe cleanup
-    auto sptr = std::shared_ptr<void>(ptr, [](void* p) {
-        free(p);
-        });
+    /* Doubles the table when it's mostly live entries, otherwise just drops the tombstones */
+    void rehash(shard_s& shard)
+    {
+        size_t new_capacity = shard.table.empty() ? initial_shard_capacity : shard.table.size();
+        if (((shard.num_of_entries + 1) * 2) > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+
+        std::vector<entry_s> old_table(new_capacity);
+        old_table.swap(shard.table);
+        shard.num_of_entries = 0;
+        shard.num_of_tombstones = 0;
+
+        for (entry_s& entry : old_table)
+        {
+            if ((entry.address != nullptr) && (entry.address != tombstone()))
+            {
+                insert(shard, std::move(entry.sptr));
+            }
+        }
+    }
+
+    _Alloc  m_allocator;
+    shard_s m_shards[NumOfShards];
+};
+
 
-    // Store in the map
-    shared_ptr_per_address[ptr] = sptr;
+inline safe_malloc_registry<>& default_safe_malloc_registry()
+{
+    static safe_malloc_registry<> registry;
+    return registry;
+}
 
-    return sptr;
+inline std::weak_ptr<void> safe_malloc(size_t size) {
+    return default_safe_malloc_registry().allocate(size);
 }
 
-void safe_free(std::weak_ptr<void> wptr)
+inline void safe_free(std::weak_ptr<void> wptr)
 {
-    if (std::shared_ptr<void> sptr = wptr.lock())
-    {
-        void* ptr = sptr.get();
-        shared_ptr_per_address.erase(ptr);
-    }
+    default_safe_malloc_registry().release(wptr);
 }
 
 #endif
@@ -0,0 +1,210 @@
+#include "dynamic_safe_queue.h"
+#include "test_check.h"
+#include <cstring>
+#include <deque>
+#include <random>
+#include <vector>
+
+
+// The segment file is unlinked right after it is mapped, the name only has to be writable
+#define SPILL_SEGMENT_PATH "dynamic_safe_queue_spill_test.seg"
+#define MAX_ITEM_SIZE (64)
+
+
+/* Items carry their sequence number followed by a byte pattern derived from it */
+static std::vector<uint8_t> make_item(uint32_t sequence, uint32_t item_size)
+{
+    std::vector<uint8_t> item(item_size);
+    memcpy(item.data(), &sequence, sizeof(sequence));
+    for (uint32_t i = sizeof(sequence); i < item_size; ++i)
+    {
+        item[i] = (uint8_t)(sequence + i);
+    }
+
+    return item;
+}
+
+static bool init_spilling_queue(queue_handler_s* queue_handler, uint32_t queue_size_in_bytes,
+                                uint32_t segment_size_in_bytes, const queue_growth_policy_s& growth_policy = {})
+{
+    queue_spill_policy_s spill_policy = {};
+    spill_policy.segment_file_path = SPILL_SEGMENT_PATH;
+    spill_policy.segment_size_in_bytes = segment_size_in_bytes;
+    return dynamic_safe_queue::get_instance()->init_queue(queue_handler, queue_size_in_bytes, growth_policy, spill_policy);
+}
+
+static void check_dequeue(queue_handler_s* queue_handler, const std::vector<uint8_t>& expected_item)
+{
+    uint8_t item[MAX_ITEM_SIZE] = {};
+    uint32_t actual_item_size_in_bytes = 0;
+    CHECK(dynamic_safe_queue::get_instance()->dequeue(queue_handler, item, sizeof(item), &actual_item_size_in_bytes));
+    CHECK(actual_item_size_in_bytes == expected_item.size());
+    CHECK(0 == memcmp(item, expected_item.data(), expected_item.size()));
+}
+
+
+/* Items overflowing the ring go to the segment and come back in order, size() counts both */
+static void test_fifo_across_ring_segment_and_replay()
+{
+    queue_handler_s queue_handler = {};
+    CHECK(init_spilling_queue(&queue_handler, 64, 4096));
+
+    std::deque<std::vector<uint8_t>> expected_items;
+    for (uint32_t sequence = 0; sequence < 40; ++sequence)
+    {
+        std::vector<uint8_t> item = make_item(sequence, 4 + (sequence % 13));
+        CHECK(dynamic_safe_queue::get_instance()->enqueue(&queue_handler, item.data(), (uint32_t)item.size()));
+        expected_items.push_back(item);
+        CHECK(dynamic_safe_queue::get_instance()->size(&queue_handler) == expected_items.size());
+    }
+
+    // A 64 byte ring can't hold 40 items, most of them must have been spilled
+    CHECK(queue_handler.spill.num_of_items > 0);
+    CHECK(queue_handler.num_of_items_in_q < expected_items.size());
+
+    // Dequeues replay spilled items into the ring while new items keep going behind them
+    for (uint32_t sequence = 40; sequence < 80; ++sequence)
+    {
+        check_dequeue(&queue_handler, expected_items.front());
+        expected_items.pop_front();
+
+        std::vector<uint8_t> item = make_item(sequence, 4 + (sequence % 13));
+        CHECK(dynamic_safe_queue::get_instance()->enqueue(&queue_handler, item.data(), (uint32_t)item.size()));
+        expected_items.push_back(item);
+        CHECK(dynamic_safe_queue::get_instance()->size(&queue_handler) == expected_items.size());
+    }
+
+    while (!expected_items.empty())
+    {
+        check_dequeue(&queue_handler, expected_items.front());
+        expected_items.pop_front();
+        CHECK(dynamic_safe_queue::get_instance()->size(&queue_handler) == expected_items.size());
+    }
+
+    uint8_t item[MAX_ITEM_SIZE];
+    uint32_t actual_item_size_in_bytes = 0;
+    CHECK(!dynamic_safe_queue::get_instance()->dequeue(&queue_handler, item, sizeof(item), &actual_item_size_in_bytes));
+    CHECK(0 == queue_handler.spill.num_of_items);
+
+    dynamic_safe_queue::get_instance()->destroy_queue(&queue_handler);
+}
+
+/* Once ring and segment are full enqueue fails without losing or reordering anything */
+static void test_rejects_when_segment_is_full()
+{
+    queue_handler_s queue_handler = {};
+    CHECK(init_spilling_queue(&queue_handler, 64, 256));
+
+    std::deque<std::vector<uint8_t>> expected_items;
+    uint32_t sequence = 0;
+    while (true)
+    {
+        std::vector<uint8_t> item = make_item(sequence, 16);
+        if (!dynamic_safe_queue::get_instance()->enqueue(&queue_handler, item.data(), (uint32_t)item.size()))
+        {
+            break;
+        }
+
+        expected_items.push_back(item);
+        ++sequence;
+        CHECK(sequence < 1000);
+    }
+
+    CHECK(queue_handler.spill.num_of_items > 0);
+    CHECK(dynamic_safe_queue::get_instance()->size(&queue_handler) == expected_items.size());
+    CHECK(1 == dynamic_safe_queue::get_instance()->snapshot(&queue_handler).failed_enqueues);
+
+    // Still full, the rejected item must not show up later
+    std::vector<uint8_t> rejected_item = make_item(sequence, 16);
+    CHECK(!dynamic_safe_queue::get_instance()->enqueue(&queue_handler, rejected_item.data(), (uint32_t)rejected_item.size()));
+    CHECK(dynamic_safe_queue::get_instance()->size(&queue_handler) == expected_items.size());
+
+    // Draining one item makes room again
+    check_dequeue(&queue_handler, expected_items.front());
+    expected_items.pop_front();
+
+    std::vector<uint8_t> item = make_item(sequence, 16);
+    CHECK(dynamic_safe_queue::get_instance()->enqueue(&queue_handler, item.data(), (uint32_t)item.size()));
+    expected_items.push_back(item);
+
+    while (!expected_items.empty())
+    {
+        check_dequeue(&queue_handler, expected_items.front());
+        expected_items.pop_front();
+    }
+
+    CHECK(0 == dynamic_safe_queue::get_instance()->size(&queue_handler));
+
+    dynamic_safe_queue::get_instance()->destroy_queue(&queue_handler);
+}
+
+/* Random enqueue/dequeue mix against a std::deque model, with and without a growing ring */
+static void test_random_operations_match_model(const queue_growth_policy_s& growth_policy)
+{
+    queue_handler_s queue_handler = {};
+    CHECK(init_spilling_queue(&queue_handler, 64, 1024, growth_policy));
+
+    std::mt19937 generator(42);
+    std::deque<std::vector<uint8_t>> expected_items;
+    uint32_t sequence = 0;
+    uint64_t rejected_items = 0;
+
+    for (uint32_t operation = 0; operation < 20000; ++operation)
+    {
+        if ((generator() % 100) < 55)
+        {
+            std::vector<uint8_t> item = make_item(sequence, 4 + (generator() % (MAX_ITEM_SIZE - 4)));
+            if (dynamic_safe_queue::get_instance()->enqueue(&queue_handler, item.data(), (uint32_t)item.size()))
+            {
+                expected_items.push_back(item);
+                ++sequence;
+            }
+            else
+            {
+                ++rejected_items;
+            }
+        }
+        else if (!expected_items.empty())
+        {
+            check_dequeue(&queue_handler, expected_items.front());
+            expected_items.pop_front();
+        }
+
+        CHECK(dynamic_safe_queue::get_instance()->size(&queue_handler) == expected_items.size());
+    }
+
+    // The mix must have exercised the full segment path as well
+    CHECK(rejected_items > 0);
+    CHECK(dynamic_safe_queue::get_instance()->snapshot(&queue_handler).failed_enqueues == rejected_items);
+
+    while (!expected_items.empty())
+    {
+        check_dequeue(&queue_handler, expected_items.front());
+        expected_items.pop_front();
+    }
+
+    dynamic_safe_queue::get_instance()->destroy_queue(&queue_handler);
+}
+
+
+int main()
+{
+#ifdef _WIN32
+    // Spilling maps its segment with mmap, there is nothing to test on Windows
+    return 0;
+#endif
+    test_fifo_across_ring_segment_and_replay();
+    test_rejects_when_segment_is_full();
+
+    queue_growth_policy_s fixed_size_policy = {};
+    test_random_operations_match_model(fixed_size_policy);
+
+    queue_growth_policy_s growth_policy = {};
+    growth_policy.max_queue_size_in_bytes = 256;
+    growth_policy.growth_factor = 2;
+    growth_policy.shrink_occupancy_percent = 25;
+    growth_policy.shrink_after_dequeues = 8;
+    test_random_operations_match_model(growth_policy);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "mem_pool.h"
+#include "test_check.h"
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+
+/* A free block too small to split must not stop the first-fit search */
+static void test_skips_free_block_too_small_to_split()
+{
+    memory_pool<> pool(4096);
+    void* ptr1 = pool.malloc(100);
+    void* ptr2 = pool.malloc(100);
+    void* ptr3 = pool.malloc(100);
+    pool.free(ptr2);
+
+    void* ptr4 = pool.malloc(90); // Takes the whole 100 byte hole, the remainder can't hold a block
+    CHECK(ptr4 == ptr2);
+
+    void* ptr5 = pool.malloc(200);
+    CHECK(ptr5 != nullptr);
+
+    pool.free(ptr1);
+    pool.free(ptr3);
+    pool.free(ptr4);
+    pool.free(ptr5);
+
+    memory_pool_heap_stats_s stats = pool.heap_stats();
+    CHECK(stats.used_blocks == 0);
+    CHECK(stats.free_blocks == 1);
+}
+
+/* The last block must only be handed out when it is free */
+static void test_never_hands_out_used_block()
+{
+    memory_pool<> pool(1024);
+    std::vector<void*> ptrs;
+    while (void* ptr = pool.malloc(64))
+    {
+        for (void* other : ptrs)
+        {
+            CHECK(other != ptr);
+        }
+
+        ptrs.push_back(ptr);
+    }
+
+    CHECK(!ptrs.empty());
+    CHECK(pool.heap_stats().used_blocks == ptrs.size());
+}
+
+/* Interleaved threads fragment the pool, a mostly empty pool must still serve every request */
+static void test_concurrent_allocations_never_fail()
+{
+    memory_pool<> pool(16 * 1024 * 1024);
+    std::atomic<uint32_t> failed_allocations(0);
+
+    std::vector<std::thread> threads;
+    for (uint32_t thread_index = 0; thread_index < 4; ++thread_index)
+    {
+        threads.emplace_back([&, thread_index]()
+            {
+                std::mt19937 generator(thread_index);
+                void* ptrs[64];
+                size_t sizes[64];
+
+                for (uint32_t round = 0; round < 500; ++round)
+                {
+                    for (uint32_t i = 0; i < 64; ++i)
+                    {
+                        sizes[i] = 16 + (generator() % 4096);
+                        ptrs[i] = pool.malloc(sizes[i], ((i % 5) == 0) ? 64 : 0);
+                        if (!ptrs[i])
+                        {
+                            ++failed_allocations;
+                            continue;
+                        }
+
+                        memset(ptrs[i], (int)thread_index, sizes[i]);
+                    }
+
+                    for (uint32_t i = 0; i < 64; ++i)
+                    {
+                        if (ptrs[i])
+                        {
+                            CHECK(((uint8_t*)ptrs[i])[sizes[i] - 1] == thread_index);
+                            pool.free(ptrs[i]);
+                        }
+                    }
+                }
+            });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    CHECK(failed_allocations.load() == 0);
+
+    memory_pool_heap_stats_s stats = pool.heap_stats();
+    CHECK(stats.used_blocks == 0);
+    CHECK(stats.free_blocks == 1);
+}
+
+
+int main()
+{
+    test_skips_free_block_too_small_to_split();
+    test_never_hands_out_used_block();
+    test_concurrent_allocations_never_fail();
+    return 0;
+}
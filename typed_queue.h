@@ -0,0 +1,346 @@
+#ifndef TYPED_QUEUE_H
+#define TYPED_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+/* Producer/consumer topologies a typed_queue can be specialized for */
+struct spsc_policy
+{
+    static constexpr bool multi_producer = false;
+    static constexpr bool multi_consumer = false;
+};
+
+struct mpsc_policy
+{
+    static constexpr bool multi_producer = true;
+    static constexpr bool multi_consumer = false;
+};
+
+struct mpmc_policy
+{
+    static constexpr bool multi_producer = true;
+    static constexpr bool multi_consumer = true;
+};
+
+
+/*
+ * Bounded lock-free queue of T with a compile-time power-of-two capacity.
+ * Unlike dynamic_safe_queue there is no per-item length prefix and no wrap handling:
+ * every slot holds exactly one T and indices are reduced with a mask.
+ *
+ * The multi-producer and multi-consumer flavors keep a sequence number per slot
+ * (Vyukov's bounded queue) and only pay for a CAS on the side that is actually shared.
+ * The SPSC flavor below is a plain ring over an aligned array of T.
+ */
+template<typename T, size_t Capacity, typename Policy = mpmc_policy>
+class typed_queue final
+{
+public:
+    typed_queue()
+        : m_enqueue_pos(0),
+          m_dequeue_pos(0)
+    {
+        for (size_t i = 0; i < Capacity; ++i)
+        {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~typed_queue()
+    {
+        slot_s* slot = nullptr;
+        size_t pos = 0;
+        while (acquire_dequeue_slot(slot, pos))
+        {
+            if (slot->constructed)
+            {
+                reinterpret_cast<T*>(slot->storage)->~T();
+            }
+
+            slot->sequence.store(pos + Capacity, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const T& item)
+    {
+        return emplace(item);
+    }
+
+    bool push(T&& item)
+    {
+        return emplace(std::move(item));
+    }
+
+    template<typename... Args>
+    bool emplace(Args&&... args)
+    {
+        slot_s* slot = nullptr;
+        size_t pos = 0;
+        if (!acquire_enqueue_slot(slot, pos))
+        {
+            return false;
+        }
+
+#ifdef __EXCEPTIONS
+        try
+        {
+            new (slot->storage) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            // The position is already claimed, publish it as empty so consumers skip it instead of stalling
+            slot->constructed = false;
+            slot->sequence.store(pos + 1, std::memory_order_release);
+            throw;
+        }
+#else
+        new (slot->storage) T(std::forward<Args>(args)...);
+#endif
+
+        slot->constructed = true;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        slot_s* slot = nullptr;
+        size_t pos = 0;
+        while (acquire_dequeue_slot(slot, pos))
+        {
+            bool constructed = slot->constructed;
+            if (constructed)
+            {
+                T* stored_item = reinterpret_cast<T*>(slot->storage);
+                item = std::move(*stored_item);
+                stored_item->~T();
+            }
+
+            slot->sequence.store(pos + Capacity, std::memory_order_release);
+
+            if (constructed)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /* Approximate when producers or consumers are running concurrently */
+    size_t size() const
+    {
+        size_t enqueue_pos = m_enqueue_pos.load(std::memory_order_acquire);
+        size_t dequeue_pos = m_dequeue_pos.load(std::memory_order_acquire);
+        return (enqueue_pos >= dequeue_pos) ? (enqueue_pos - dequeue_pos) : 0;
+    }
+
+    static constexpr size_t capacity()
+    {
+        return Capacity;
+    }
+
+private:
+    static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0), "capacity must be a power of two!");
+    static_assert(std::is_nothrow_destructible<T>::value, "T must be nothrow destructible!");
+
+    typed_queue(const typed_queue&);
+    typed_queue& operator=(const typed_queue&);
+
+    static constexpr size_t cache_line_size = 64;
+    static constexpr size_t index_mask = Capacity - 1;
+
+    struct slot_s
+    {
+        std::atomic<size_t> sequence;    /* pos when free for the producer of pos, pos + 1 when filled for its consumer */
+        bool                constructed; /* false when T's constructor threw, the consumer skips the slot */
+        alignas(T) uint8_t storage[sizeof(T)];
+    };
+
+    bool acquire_enqueue_slot(slot_s*& slot, size_t& pos)
+    {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            slot = &m_slots[pos & index_mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+            if (diff < 0) // Full
+            {
+                return false;
+            }
+
+            if (diff > 0) // Another producer took this position
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (!Policy::multi_producer)
+            {
+                m_enqueue_pos.store(pos + 1, std::memory_order_relaxed);
+                return true;
+            }
+
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    bool acquire_dequeue_slot(slot_s*& slot, size_t& pos)
+    {
+        pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            slot = &m_slots[pos & index_mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+            if (diff < 0) // Empty
+            {
+                return false;
+            }
+
+            if (diff > 0) // Another consumer took this position
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if (!Policy::multi_consumer)
+            {
+                m_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+                return true;
+            }
+
+            if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    alignas(cache_line_size) slot_s m_slots[Capacity];
+    alignas(cache_line_size) std::atomic<size_t> m_enqueue_pos;
+    alignas(cache_line_size) std::atomic<size_t> m_dequeue_pos;
+};
+
+
+template<typename T, size_t Capacity>
+class typed_queue<T, Capacity, spsc_policy> final
+{
+public:
+    typed_queue()
+        : m_head(0),
+          m_cached_tail(0),
+          m_tail(0),
+          m_cached_head(0)
+    {
+    }
+
+    ~typed_queue()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        for (; head != tail; ++head)
+        {
+            item_at(head)->~T();
+        }
+    }
+
+    bool push(const T& item)
+    {
+        return emplace(item);
+    }
+
+    bool push(T&& item)
+    {
+        return emplace(std::move(item));
+    }
+
+    template<typename... Args>
+    bool emplace(Args&&... args)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if ((tail - m_cached_head) == Capacity)
+        {
+            m_cached_head = m_head.load(std::memory_order_acquire);
+            if ((tail - m_cached_head) == Capacity) // Full
+            {
+                return false;
+            }
+        }
+
+        new (item_at(tail)) T(std::forward<Args>(args)...);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cached_tail)
+        {
+            m_cached_tail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cached_tail) // Empty
+            {
+                return false;
+            }
+        }
+
+        T* stored_item = item_at(head);
+        item = std::move(*stored_item);
+        stored_item->~T();
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Approximate when the producer or the consumer is running concurrently */
+    size_t size() const
+    {
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        return (tail >= head) ? (tail - head) : 0;
+    }
+
+    static constexpr size_t capacity()
+    {
+        return Capacity;
+    }
+
+private:
+    static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0), "capacity must be a power of two!");
+    static_assert(std::is_nothrow_destructible<T>::value, "T must be nothrow destructible!");
+
+    typed_queue(const typed_queue&);
+    typed_queue& operator=(const typed_queue&);
+
+    static constexpr size_t cache_line_size = 64;
+    static constexpr size_t index_mask = Capacity - 1;
+
+    T* item_at(size_t pos)
+    {
+        return reinterpret_cast<T*>(m_storage) + (pos & index_mask);
+    }
+
+    alignas(cache_line_size) alignas(T) uint8_t m_storage[Capacity * sizeof(T)];
+
+    /* Consumer side: its own index and its last view of the producer index */
+    alignas(cache_line_size) std::atomic<size_t> m_head;
+    size_t m_cached_tail;
+
+    /* Producer side: its own index and its last view of the consumer index */
+    alignas(cache_line_size) std::atomic<size_t> m_tail;
+    size_t m_cached_head;
+};
+
+#endif // TYPED_QUEUE_H